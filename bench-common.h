@@ -0,0 +1,98 @@
+/*
+ * bench-common.h: Timing and reporting shared by the benchmarks
+ *
+ * Every benchmark in bench_t runs a number of rounds, each consisting
+ * of a fixed number of operations, and bench_run() reports the time
+ * per operation (in nanoseconds) for the rounds as percentiles, as one
+ * JSON object per line. Data a round needs (e.g. unique type names) is
+ * prepared and freed again outside of the timed region.
+ */
+#ifndef GTK3_NOCSD_BENCH_COMMON_H
+#define GTK3_NOCSD_BENCH_COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct bench_t bench_t;
+
+typedef void (*bench_func_t) (int ops, void *data);
+
+struct bench_t {
+  const char *name;
+  bench_func_t func;
+  int rounds;
+  int ops;
+  /* Optional: returns the data passed to func in a round (the default
+   * is the round number plus one) and frees it again afterwards */
+  void *(*setup) (const bench_t *bench, int round);
+  void (*cleanup) (const bench_t *bench, void *data);
+  /* Optional: prints additional members of the JSON object */
+  void (*report) (const bench_t *bench);
+};
+
+static inline double now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static inline int compare_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static inline double percentile (const double *sorted, int n, double q)
+{
+  return sorted[(int) (q * (n - 1) + 0.5)];
+}
+
+/* preloaded is just a label for the output */
+static inline void bench_run (const bench_t *bench, const char *preloaded)
+{
+  double *samples = calloc (bench->rounds, sizeof (double));
+  double start, total = 0;
+  int round;
+
+  for (round = 0; round < bench->rounds; round++) {
+    void *data = bench->setup ? bench->setup (bench, round) : (void *) (size_t) (round + 1);
+
+    start = now_ns ();
+    bench->func (bench->ops, data);
+    samples[round] = (now_ns () - start) / bench->ops;
+    total += samples[round];
+
+    if (bench->cleanup)
+      bench->cleanup (bench, data);
+  }
+
+  qsort (samples, bench->rounds, sizeof (double), compare_double);
+  printf ("{\"benchmark\": \"%s\", \"preload\": \"%s\", \"rounds\": %d, \"ops_per_round\": %d, "
+          "\"ns_per_op\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f, \"mean\": %.1f}",
+          bench->name, preloaded, bench->rounds, bench->ops,
+          samples[0], percentile (samples, bench->rounds, 0.5), percentile (samples, bench->rounds, 0.9),
+          percentile (samples, bench->rounds, 0.99), samples[bench->rounds - 1], total / bench->rounds);
+  if (bench->report)
+    bench->report (bench);
+  printf ("}\n");
+  fflush (stdout);
+  free (samples);
+}
+
+/* Runs all benchmarks up to the one without a name, or only the one
+ * called only if that is not NULL */
+static inline void bench_run_all (const bench_t *benchmarks, const char *preloaded, const char *only)
+{
+  const bench_t *bench;
+
+  for (bench = benchmarks; bench->name; bench++) {
+    if (only && strcmp (only, bench->name) != 0)
+      continue;
+    bench_run (bench, preloaded);
+  }
+}
+
+#endif
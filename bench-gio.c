@@ -0,0 +1,148 @@
+/*
+ * bench-gio: Measure the overhead libgtk3-nocsd.so adds to a program
+ * that uses GLib, GObject and GIO, but not Gtk
+ *
+ * With the library preloaded globally, such programs still go through
+ * its GObject hooks, so this copies a file with GIO over and over
+ * again and also calls the interposed GObject functions directly. Like
+ * bench-nocsd, every benchmark runs a number of rounds of a fixed
+ * number of operations and reports the time per operation (in
+ * nanoseconds) as percentiles. The Makefile runs this program once
+ * without and once with the library preloaded (the first argument is
+ * just a label for the output).
+ *
+ * Output is one JSON object per line and benchmark. No display is
+ * required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "bench-common.h"
+
+static const char *preloaded = "none";
+
+static GFile *source;
+static GFile *destination;
+static GCancellable *cancellable;
+static GSimpleAction *action;
+
+static void bench_g_file_copy (int ops, gpointer data)
+{
+  GError *error = NULL;
+  int i;
+  for (i = 0; i < ops; i++) {
+    if (!g_file_copy (source, destination, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &error)) {
+      fprintf (stderr, "ERROR[preloaded = %s]: could not copy file: %s\n", preloaded, error->message);
+      exit (1);
+    }
+  }
+}
+
+static void dummy_cancelled (GCancellable *c, gpointer data)
+{
+}
+
+static void bench_g_cancellable_connect (int ops, gpointer data)
+{
+  gulong id;
+  int i;
+  for (i = 0; i < ops; i++) {
+    id = g_cancellable_connect (cancellable, G_CALLBACK (dummy_cancelled), NULL, NULL);
+    g_cancellable_disconnect (cancellable, id);
+  }
+}
+
+static void bench_g_object_get (int ops, gpointer data)
+{
+  gboolean enabled;
+  int i;
+  for (i = 0; i < ops; i++)
+    g_object_get (action, "enabled", &enabled, NULL);
+}
+
+static void bench_g_type_register_static_simple (int ops, gpointer data)
+{
+  char **names = data;
+  int i;
+  for (i = 0; i < ops; i++)
+    g_type_register_static_simple (G_TYPE_OBJECT, names[i], sizeof (GObjectClass), NULL,
+                                   sizeof (GObject), NULL, 0);
+}
+
+/* Type names must be unique, generate them outside of the timed
+ * region. */
+static void *setup_type_names (const bench_t *bench, int round)
+{
+  char **names = calloc (bench->ops, sizeof (char *));
+  int i;
+  for (i = 0; i < bench->ops; i++)
+    names[i] = g_strdup_printf ("BenchGio%s%d_%d", preloaded, round, i);
+  return names;
+}
+
+static void cleanup_type_names (const bench_t *bench, void *data)
+{
+  char **names = data;
+  int i;
+  for (i = 0; i < bench->ops; i++)
+    g_free (names[i]);
+  free (names);
+}
+
+static const bench_t benchmarks[] = {
+  { "g_file_copy",                    bench_g_file_copy,                    50,  100 },
+  { "g_cancellable_connect",          bench_g_cancellable_connect,         200, 1000 },
+  { "g_object_get",                   bench_g_object_get,                  200, 1000 },
+  { "g_type_register_static_simple",  bench_g_type_register_static_simple,  50,  200,
+    setup_type_names, cleanup_type_names },
+  { NULL, NULL, 0, 0 }
+};
+
+int main (int argc, char **argv)
+{
+  const char *only = NULL;
+  GError *error = NULL;
+  gchar *dir, *path;
+  gchar contents[65536];
+
+  if (argc >= 2)
+    preloaded = argv[1];
+  if (argc >= 3)
+    only = argv[2];
+
+  dir = g_dir_make_tmp ("bench-gio-XXXXXX", &error);
+  if (!dir) {
+    fprintf (stderr, "ERROR[preloaded = %s]: could not create temporary directory: %s\n", preloaded, error->message);
+    return 1;
+  }
+  memset (contents, 'x', sizeof (contents));
+  path = g_build_filename (dir, "source", NULL);
+  if (!g_file_set_contents (path, contents, sizeof (contents), &error)) {
+    fprintf (stderr, "ERROR[preloaded = %s]: could not write %s: %s\n", preloaded, path, error->message);
+    return 1;
+  }
+  source = g_file_new_for_path (path);
+  g_free (path);
+  path = g_build_filename (dir, "destination", NULL);
+  destination = g_file_new_for_path (path);
+  g_free (path);
+
+  cancellable = g_cancellable_new ();
+  action = g_simple_action_new ("bench", NULL);
+
+  bench_run_all (benchmarks, preloaded, only);
+
+  g_file_delete (destination, NULL, NULL);
+  g_file_delete (source, NULL, NULL);
+  g_rmdir (dir);
+  g_object_unref (destination);
+  g_object_unref (source);
+  g_object_unref (cancellable);
+  g_object_unref (action);
+  g_free (dir);
+  return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * bench-launch: Compare the overhead of starting a program through
+ * the gtk3-nocsd launcher with that of the old wrapper script
+ *
+ * Every launcher given on the command line is copied to a temporary
+ * directory of its own (as "gtk3-nocsd", next to a symlink to the
+ * library given as the first argument and a symlink "true" pointing to
+ * the launcher). Then /bin/true is started a number of times in each
+ * of the two modes of operation: directly ("gtk3-nocsd /bin/true") and
+ * through the symlink (with the temporary directory first in the
+ * PATH). The time is measured from just before fork() to the end of
+ * waitpid(). As a baseline, /bin/true is also run with the library
+ * preloaded directly.
+ *
+ * Note that the launchers are not in the system path here, so the
+ * additional test run the script does when installed into /usr/bin
+ * is not part of the result.
+ *
+ * Output is one JSON object per line.
+ *
+ * Usage: bench-launch /path/to/libgtk3-nocsd.so.0 iterations launcher...
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench-common.h"
+
+static int copy_file (const char *from, const char *to)
+{
+  char buf[65536];
+  ssize_t n;
+  int in, out, r = 0;
+
+  in = open (from, O_RDONLY);
+  if (in < 0)
+    return -1;
+  out = open (to, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+  if (out < 0) {
+    close (in);
+    return -1;
+  }
+  while ((n = read (in, buf, sizeof (buf))) > 0) {
+    if (write (out, buf, n) != n) {
+      r = -1;
+      break;
+    }
+  }
+  if (n < 0)
+    r = -1;
+  close (in);
+  close (out);
+  return r;
+}
+
+/* Start argv[0] with the given PATH and LD_PRELOAD (NULL to unset),
+ * wait for it and return the time that took, or -1 if it failed. */
+static double run_once (char **argv, const char *path, const char *preload)
+{
+  double start;
+  pid_t pid;
+  int status, fd;
+
+  start = now_ns ();
+  pid = fork ();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    fd = open ("/dev/null", O_WRONLY);
+    if (fd >= 0) {
+      dup2 (fd, 1);
+      dup2 (fd, 2);
+    }
+    setenv ("PATH", path, 1);
+    if (preload)
+      setenv ("LD_PRELOAD", preload, 1);
+    else
+      unsetenv ("LD_PRELOAD");
+    execv (argv[0], argv);
+    _exit (127);
+  }
+  if (waitpid (pid, &status, 0) < 0 || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    return -1;
+  return now_ns () - start;
+}
+
+static double report (const char *launcher, const char *mode, double *samples, int n, double baseline)
+{
+  double total = 0, p50;
+  int i;
+
+  qsort (samples, n, sizeof (double), compare_double);
+  for (i = 0; i < n; i++)
+    total += samples[i];
+  p50 = samples[n / 2];
+  printf ("{\"benchmark\": \"launch\", \"launcher\": \"%s\", \"mode\": \"%s\", \"iterations\": %d, "
+          "\"launch_ns\": {\"min\": %.0f, \"p50\": %.0f, \"p90\": %.0f, \"max\": %.0f, \"mean\": %.0f}, "
+          "\"p50_overhead_ns\": %.0f}\n",
+          launcher, mode, n, samples[0], p50, percentile (samples, n, 0.9), samples[n - 1],
+          total / n, baseline >= 0 ? p50 - baseline : 0);
+  fflush (stdout);
+  return p50;
+}
+
+int main (int argc, char **argv)
+{
+  char tmpdir[] = "/tmp/bench-launch-XXXXXX";
+  char library[PATH_MAX];
+  char dir[sizeof (tmpdir) + 16], launcher[PATH_MAX], link_path[PATH_MAX], lib_link[PATH_MAX], path[PATH_MAX * 2];
+  const char *old_path = getenv ("PATH");
+  char *direct_argv[] = { launcher, "/bin/true", NULL };
+  char *symlink_argv[] = { link_path, NULL };
+  char *baseline_argv[] = { "/bin/true", NULL };
+  double *samples;
+  double baseline;
+  int iterations, i, l, ret = 1;
+
+  if (argc < 4) {
+    fprintf (stderr, "Usage: %s /path/to/libgtk3-nocsd.so.0 iterations launcher...\n", argv[0]);
+    return 1;
+  }
+  if (!realpath (argv[1], library)) {
+    fprintf (stderr, "ERROR: %s: %s\n", argv[1], strerror (errno));
+    return 1;
+  }
+  iterations = atoi (argv[2]);
+  if (iterations < 1)
+    iterations = 1;
+  if (!old_path)
+    old_path = "/bin:/usr/bin";
+  if (!mkdtemp (tmpdir)) {
+    fprintf (stderr, "ERROR: could not create temporary directory: %s\n", strerror (errno));
+    return 1;
+  }
+  samples = calloc (iterations, sizeof (double));
+
+  /* One untimed run first, so that the baseline starts with warm caches
+   * as well. */
+  run_once (baseline_argv, old_path, library);
+  for (i = 0; i < iterations; i++) {
+    if ((samples[i] = run_once (baseline_argv, old_path, library)) < 0) {
+      fprintf (stderr, "ERROR: could not run /bin/true\n");
+      goto out;
+    }
+  }
+  baseline = report ("none", "preload", samples, iterations, -1);
+
+  for (l = 3; l < argc; l++) {
+    snprintf (dir, sizeof (dir), "%s/%d", tmpdir, l);
+    snprintf (launcher, sizeof (launcher), "%s/gtk3-nocsd", dir);
+    snprintf (link_path, sizeof (link_path), "%s/true", dir);
+    snprintf (lib_link, sizeof (lib_link), "%s/libgtk3-nocsd.so.0", dir);
+    snprintf (path, sizeof (path), "%s:%s", dir, old_path);
+    if (mkdir (dir, 0700) < 0 || copy_file (argv[l], launcher) < 0 ||
+        symlink ("gtk3-nocsd", link_path) < 0 || symlink (library, lib_link) < 0) {
+      fprintf (stderr, "ERROR: could not set up %s: %s\n", argv[l], strerror (errno));
+      goto out;
+    }
+
+    run_once (direct_argv, old_path, NULL);
+    for (i = 0; i < iterations; i++) {
+      if ((samples[i] = run_once (direct_argv, old_path, NULL)) < 0) {
+        fprintf (stderr, "ERROR: %s /bin/true failed\n", argv[l]);
+        goto out;
+      }
+    }
+    report (argv[l], "direct", samples, iterations, baseline);
+
+    run_once (symlink_argv, path, NULL);
+    for (i = 0; i < iterations; i++) {
+      if ((samples[i] = run_once (symlink_argv, path, NULL)) < 0) {
+        fprintf (stderr, "ERROR: true -> %s failed\n", argv[l]);
+        goto out;
+      }
+    }
+    report (argv[l], "symlink", samples, iterations, baseline);
+  }
+  ret = 0;
+
+out:
+  for (l = 3; l < argc; l++) {
+    snprintf (dir, sizeof (dir), "%s/%d", tmpdir, l);
+    snprintf (launcher, sizeof (launcher), "%s/gtk3-nocsd", dir);
+    snprintf (link_path, sizeof (link_path), "%s/true", dir);
+    snprintf (lib_link, sizeof (lib_link), "%s/libgtk3-nocsd.so.0", dir);
+    unlink (launcher);
+    unlink (link_path);
+    unlink (lib_link);
+    rmdir (dir);
+  }
+  rmdir (tmpdir);
+  free (samples);
+  return ret;
+}
@@ -0,0 +1,263 @@
+/*
+ * bench-nocsd: Measure the overhead of the functions interposed by
+ * libgtk3-nocsd.so
+ *
+ * Every benchmark runs a number of rounds, each consisting of a fixed
+ * number of calls to the function in question, and reports the time
+ * per call (in nanoseconds) for the rounds as percentiles. The Makefile
+ * runs this program once without and once with the library preloaded
+ * (the first argument is just a label for the output), so that the
+ * two results can be compared.
+ *
+ * Output is one JSON object per line and benchmark.
+ *
+ * A display is required (the Makefile uses Xvfb by default, but the
+ * GDK broadway backend works as well).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gtk/gtk.h>
+
+#include "bench-common.h"
+
+static const char *preloaded = "none";
+
+static GtkWidget *window;
+static GtkWidget *header_bar;
+static GtkWidget *realized_window;
+static GtkWidget *realized_header_bar;
+
+/* Number of GtkStyleContext::changed emissions seen by benchmarks that
+ * count them, reported per operation. */
+static unsigned long style_changes;
+
+static void dummy_callback (GObject *object, GParamSpec *pspec, gpointer data)
+{
+}
+
+static void bench_g_signal_connect_data (int ops, gpointer data)
+{
+  int i;
+  for (i = 0; i < ops; i++)
+    g_signal_connect_data (window, "notify::title", G_CALLBACK (dummy_callback), data, NULL, 0);
+}
+
+static void cleanup_g_signal_connect_data (const bench_t *bench, void *data)
+{
+  g_signal_handlers_disconnect_by_func (window, dummy_callback, data);
+}
+
+static void bench_g_object_get (int ops, gpointer data)
+{
+  gboolean resizable;
+  int i;
+  for (i = 0; i < ops; i++)
+    g_object_get (window, "resizable", &resizable, NULL);
+}
+
+static void bench_g_object_get_settings (int ops, gpointer data)
+{
+  GtkSettings *settings = gtk_settings_get_default ();
+  gchar *layout;
+  gboolean shows_app_menu;
+  int i;
+  for (i = 0; i < ops; i++) {
+    g_object_get (settings, "gtk-shell-shows-app-menu", &shows_app_menu, "gtk-decoration-layout", &layout, NULL);
+    g_free (layout);
+  }
+}
+
+static void count_style_change (GtkStyleContext *context, gpointer data)
+{
+  style_changes++;
+}
+
+static void *setup_count_style_changes (const bench_t *bench, int round)
+{
+  if (round == 0)
+    style_changes = 0;
+  return NULL;
+}
+
+static void report_style_changes (const bench_t *bench)
+{
+  printf (", \"style_changes_per_op\": %.1f", (double) style_changes / ((double) bench->rounds * bench->ops));
+}
+
+static void bench_map_window_with_header_bar (int ops, gpointer data)
+{
+  GtkWidget *w, *bar;
+  int i;
+  for (i = 0; i < ops; i++) {
+    w = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+    bar = gtk_header_bar_new ();
+    g_signal_connect (gtk_widget_get_style_context (w), "changed", G_CALLBACK (count_style_change), NULL);
+    g_signal_connect (gtk_widget_get_style_context (bar), "changed", G_CALLBACK (count_style_change), NULL);
+    gtk_header_bar_set_title (GTK_HEADER_BAR (bar), "bench-nocsd");
+    gtk_window_set_titlebar (GTK_WINDOW (w), bar);
+    gtk_widget_show_all (w);
+    while (gtk_events_pending ())
+      gtk_main_iteration ();
+    gtk_widget_destroy (w);
+  }
+}
+
+static void bench_g_type_register_static_simple (int ops, gpointer data)
+{
+  char **names = data;
+  int i;
+  for (i = 0; i < ops; i++)
+    g_type_register_static_simple (G_TYPE_OBJECT, names[i], sizeof (GObjectClass), NULL,
+                                   sizeof (GObject), NULL, 0);
+}
+
+/* Type names must be unique, generate them outside of the timed
+ * region. Vary the length a bit, like real type names. */
+static void *setup_type_names (const bench_t *bench, int round)
+{
+  char **names = calloc (bench->ops, sizeof (char *));
+  int i;
+  for (i = 0; i < bench->ops; i++)
+    names[i] = g_strdup_printf ("%.*sBenchNocsd%s%d_%d_%d", i % 8, "GtkWidget", preloaded, bench->ops, round, i);
+  return names;
+}
+
+static void cleanup_type_names (const bench_t *bench, void *data)
+{
+  char **names = data;
+  int i;
+  for (i = 0; i < bench->ops; i++)
+    g_free (names[i]);
+  free (names);
+}
+
+static GType bench_interface_type;
+
+static void bench_interface_init (gpointer iface, gpointer data)
+{
+}
+
+static void bench_g_type_add_interface_static (int ops, gpointer data)
+{
+  static const GInterfaceInfo info = { bench_interface_init, NULL, NULL };
+  GType *types = data;
+  int i;
+  for (i = 0; i < ops; i++)
+    g_type_add_interface_static (types[i], bench_interface_type, &info);
+}
+
+/* Only the interface registration itself is timed */
+static void *setup_types (const bench_t *bench, int round)
+{
+  GType *types = calloc (bench->ops, sizeof (GType));
+  int i;
+  for (i = 0; i < bench->ops; i++) {
+    gchar *name = g_strdup_printf ("BenchNocsdImpl%s%d_%d", preloaded, round, i);
+    types[i] = g_type_register_static_simple (G_TYPE_OBJECT, name, sizeof (GObjectClass), NULL,
+                                              sizeof (GObject), NULL, 0);
+    g_free (name);
+  }
+  return types;
+}
+
+static void cleanup_types (const bench_t *bench, void *data)
+{
+  free (data);
+}
+
+static void bench_gtk_window_set_titlebar (int ops, gpointer data)
+{
+  int i;
+  for (i = 0; i < ops; i++) {
+    gtk_window_set_titlebar (GTK_WINDOW (window), header_bar);
+    gtk_window_set_titlebar (GTK_WINDOW (window), NULL);
+  }
+}
+
+static void bench_gdk_window_set_decorations (int ops, gpointer data)
+{
+  GdkWindow *gdk_window = gtk_widget_get_window (realized_window);
+  int i;
+  for (i = 0; i < ops; i++)
+    gdk_window_set_decorations (gdk_window, (i & 1) ? GDK_DECOR_ALL : GDK_DECOR_BORDER);
+}
+
+static void bench_gtk_header_bar_set_decoration_layout (int ops, gpointer data)
+{
+  int i;
+  for (i = 0; i < ops; i++)
+    gtk_header_bar_set_decoration_layout (GTK_HEADER_BAR (realized_header_bar),
+                                          (i & 1) ? "menu:minimize,maximize,close" : "close:menu");
+}
+
+/* Run before GtkDialog and GtkShortcutsWindow are registered, as in
+ * programs that never use them */
+static const bench_t early_benchmarks[] = {
+  { "g_type_add_interface_static_lazy",      bench_g_type_add_interface_static,             5, 2000,
+    setup_types, cleanup_types },
+  { NULL, NULL, 0, 0 }
+};
+
+static const bench_t benchmarks[] = {
+  { "g_signal_connect_data",                 bench_g_signal_connect_data,                 200, 1000,
+    NULL, cleanup_g_signal_connect_data },
+  { "g_object_get",                          bench_g_object_get,                          200, 1000 },
+  { "g_object_get_settings",                 bench_g_object_get_settings,                 200, 1000 },
+  { "g_type_register_static_simple",         bench_g_type_register_static_simple,          50,  200,
+    setup_type_names, cleanup_type_names },
+  { "g_type_register_static_simple_10k",     bench_g_type_register_static_simple,           5, 10000,
+    setup_type_names, cleanup_type_names },
+  { "g_type_add_interface_static",           bench_g_type_add_interface_static,             5, 2000,
+    setup_types, cleanup_types },
+  { "gtk_window_set_titlebar",               bench_gtk_window_set_titlebar,               100,  100 },
+  { "gdk_window_set_decorations",            bench_gdk_window_set_decorations,            100, 1000 },
+  { "gtk_header_bar_set_decoration_layout",  bench_gtk_header_bar_set_decoration_layout,  100,  100 },
+  { "map_window_with_header_bar",            bench_map_window_with_header_bar,             20,   10,
+    setup_count_style_changes, NULL, report_style_changes },
+  { NULL, NULL, 0, 0 }
+};
+
+int main (int argc, char **argv)
+{
+  const char *only = NULL;
+
+  if (argc >= 2)
+    preloaded = argv[1];
+  if (argc >= 3)
+    only = argv[2];
+
+  if (!gtk_init_check (&argc, &argv)) {
+    fprintf (stderr, "ERROR[preloaded = %s]: could not initialize Gtk (no display?)\n", preloaded);
+    return 1;
+  }
+
+  window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  header_bar = g_object_ref_sink (gtk_header_bar_new ());
+
+  realized_window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  realized_header_bar = gtk_header_bar_new ();
+  gtk_window_set_titlebar (GTK_WINDOW (realized_window), realized_header_bar);
+  gtk_widget_realize (realized_window);
+  gtk_widget_realize (realized_header_bar);
+
+  bench_interface_type = g_type_register_static_simple (G_TYPE_INTERFACE, "BenchNocsdInterface",
+                                                        sizeof (GTypeInterface), NULL, 0, NULL, 0);
+
+  bench_run_all (early_benchmarks, preloaded, only);
+
+  /* Make sure all types libgtk3-nocsd.so is interested in are
+   * registered, like they would be in a larger application, so that
+   * g_type_add_interface_static measures types registered afterwards
+   * (e.g. by plugins or language bindings). */
+  g_type_ensure (GTK_TYPE_DIALOG);
+  g_type_ensure (GTK_TYPE_SHORTCUTS_WINDOW);
+
+  bench_run_all (benchmarks, preloaded, only);
+
+  gtk_widget_destroy (realized_window);
+  gtk_widget_destroy (window);
+  g_object_unref (header_bar);
+  return 0;
+}
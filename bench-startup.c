@@ -0,0 +1,283 @@
+/*
+ * bench-startup: Measure how much libgtk3-nocsd.so adds to the time it
+ * takes a Gtk+3 program to map its first window
+ *
+ * The program re-executes itself (with --child) a number of times,
+ * alternating between running without and with the library given on
+ * the command line preloaded. The child builds a small UI from
+ * GtkBuilder XML (a window with a header bar as title bar, a dialog
+ * with a header bar and a GtkShortcutsWindow), shows the main window
+ * and reports the time of the first map-event back through a pipe.
+ * Startup latency is measured from just before exec() to that point.
+ *
+ * With the library, the child runs once with the layout of Gtk's
+ * private data structures in the library's cache (filled by an untimed
+ * first run), and once with GTK3_NOCSD_NO_CACHE set, so that it has to
+ * probe the layout with dummy widgets, as the first program after an
+ * update of Gtk does. Both are reported separately.
+ *
+ * Each of these is also run with GTK3_NOCSD_STATS set, so the library
+ * reports how much time was spent in its own startup phases (symbol
+ * resolution, layout probing, CSS and the title bar reimplementation),
+ * which is included in the output. Those runs are only used for the
+ * phases, the startup latency (and the difference to running without
+ * the library) comes from the runs without statistics, which would add
+ * to it.
+ *
+ * Output is one JSON object per line.
+ *
+ * Usage: bench-startup /path/to/libgtk3-nocsd.so.0 [iterations]
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtk/gtk.h>
+
+#include "bench-common.h"
+
+static const char ui[] =
+  "<interface>"
+  "  <object class='GtkWindow' id='window'>"
+  "    <property name='title'>bench-startup</property>"
+  "    <property name='default-width'>320</property>"
+  "    <property name='default-height'>200</property>"
+  "    <child type='titlebar'>"
+  "      <object class='GtkHeaderBar'>"
+  "        <property name='visible'>True</property>"
+  "        <property name='title'>bench-startup</property>"
+  "        <property name='show-close-button'>True</property>"
+  "      </object>"
+  "    </child>"
+  "    <child>"
+  "      <object class='GtkLabel'>"
+  "        <property name='visible'>True</property>"
+  "        <property name='label'>bench-startup</property>"
+  "      </object>"
+  "    </child>"
+  "  </object>"
+  "  <object class='GtkDialog' id='dialog'>"
+  "    <property name='use-header-bar'>1</property>"
+  "    <property name='transient-for'>window</property>"
+  "  </object>"
+  "  <object class='GtkShortcutsWindow' id='shortcuts'/>"
+  "</interface>";
+
+typedef struct run_t {
+  double startup_ns;
+  double symbol_resolution_ns;
+  double probe_ns;
+  double css_ns;
+  double titlebar_ns;
+} run_t;
+
+static int report_fd = -1;
+
+static gboolean on_map_event (GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+  double t = now_ns ();
+  if (write (report_fd, &t, sizeof (t)) != sizeof (t))
+    exit (1);
+  /* exit() and not _exit(), the library writes its statistics from
+   * a destructor. */
+  exit (0);
+  return FALSE;
+}
+
+static int child_main (int argc, char **argv)
+{
+  GtkBuilder *builder;
+  GtkWidget *window;
+
+  report_fd = atoi (argv[2]);
+  gtk_init (&argc, &argv);
+
+  builder = gtk_builder_new_from_string (ui, -1);
+  window = GTK_WIDGET (gtk_builder_get_object (builder, "window"));
+  g_signal_connect (window, "map-event", G_CALLBACK (on_map_event), NULL);
+  gtk_widget_show (window);
+  gtk_main ();
+  return 1;
+}
+
+static double json_number (const char *line, const char *key)
+{
+  char pattern[64];
+  const char *p;
+
+  snprintf (pattern, sizeof (pattern), "\"%s\": ", key);
+  p = strstr (line, pattern);
+  return p ? strtod (p + strlen (pattern), NULL) : 0;
+}
+
+static int run_once (const char *self, const char *library, int no_cache, const char *stats_file, run_t *run)
+{
+  char fd_arg[16];
+  int fds[2];
+  double start, mapped;
+  pid_t pid;
+  int status;
+  FILE *f;
+  char *line = NULL;
+  size_t line_size = 0;
+
+  memset (run, 0, sizeof (*run));
+  if (pipe (fds) < 0)
+    return -1;
+  snprintf (fd_arg, sizeof (fd_arg), "%d", fds[1]);
+  if (stats_file)
+    unlink (stats_file);
+
+  start = now_ns ();
+  pid = fork ();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    close (fds[0]);
+    setenv ("GTK_CSD", "0", 1);
+    if (library)
+      setenv ("LD_PRELOAD", library, 1);
+    else
+      unsetenv ("LD_PRELOAD");
+    if (stats_file) {
+      setenv ("GTK3_NOCSD_STATS", "1", 1);
+      setenv ("GTK3_NOCSD_STATS_FILE", stats_file, 1);
+    } else {
+      unsetenv ("GTK3_NOCSD_STATS");
+    }
+    if (no_cache)
+      setenv ("GTK3_NOCSD_NO_CACHE", "1", 1);
+    else
+      unsetenv ("GTK3_NOCSD_NO_CACHE");
+    execl (self, self, "--child", fd_arg, (char *) NULL);
+    _exit (127);
+  }
+
+  close (fds[1]);
+  if (read (fds[0], &mapped, sizeof (mapped)) != sizeof (mapped)) {
+    close (fds[0]);
+    (void) waitpid (pid, &status, 0);
+    return -1;
+  }
+  close (fds[0]);
+  (void) waitpid (pid, &status, 0);
+  run->startup_ns = mapped - start;
+
+  /* The statistics are a single line, but of no fixed length (it has
+   * an entry for every hook, and the numbers can get long) */
+  if (stats_file && (f = fopen (stats_file, "r"))) {
+    if (getline (&line, &line_size, f) > 0) {
+      run->symbol_resolution_ns = json_number (line, "symbol_resolution_ns");
+      run->probe_ns = json_number (line, "probe_ns");
+      run->css_ns = json_number (line, "css_ns");
+      run->titlebar_ns = json_number (line, "titlebar_ns");
+    }
+    free (line);
+    fclose (f);
+  }
+  return 0;
+}
+
+static double median (double *values, int n)
+{
+  qsort (values, n, sizeof (double), compare_double);
+  return values[n / 2];
+}
+
+static double mean_of (const run_t *runs, int n, size_t offset)
+{
+  double total = 0;
+  int i;
+  for (i = 0; i < n; i++)
+    total += *(const double *) ((const char *) &runs[i] + offset);
+  return total / n;
+}
+
+/* The startup latency is taken from runs, the phases from phases (runs
+ * with GTK3_NOCSD_STATS set) */
+static void report (const char *label, const run_t *runs, const run_t *phases, int n, double *median_out)
+{
+  double *values = calloc (n, sizeof (double));
+  int i;
+
+  for (i = 0; i < n; i++)
+    values[i] = runs[i].startup_ns;
+  *median_out = median (values, n);
+  printf ("{\"benchmark\": \"startup\", \"preload\": \"%s\", \"iterations\": %d, "
+          "\"startup_ns\": {\"min\": %.0f, \"p50\": %.0f, \"max\": %.0f, \"mean\": %.0f}, "
+          "\"phases_mean_ns\": {\"symbol_resolution\": %.0f, \"probe\": %.0f, \"css\": %.0f, \"titlebar\": %.0f}}\n",
+          label, n, values[0], *median_out, values[n - 1], mean_of (runs, n, offsetof (run_t, startup_ns)),
+          mean_of (phases, n, offsetof (run_t, symbol_resolution_ns)),
+          mean_of (phases, n, offsetof (run_t, probe_ns)),
+          mean_of (phases, n, offsetof (run_t, css_ns)),
+          mean_of (phases, n, offsetof (run_t, titlebar_ns)));
+  free (values);
+}
+
+int main (int argc, char **argv)
+{
+  char stats_file[] = "/tmp/bench-startup-XXXXXX";
+  run_t *without, *with, *with_stats, *cold, *cold_stats;
+  double median_without, median_with, median_cold;
+  int iterations = 20;
+  int i, fd;
+
+  if (argc >= 3 && strcmp (argv[1], "--child") == 0)
+    return child_main (argc, argv);
+
+  if (argc < 2) {
+    fprintf (stderr, "Usage: %s /path/to/libgtk3-nocsd.so.0 [iterations]\n", argv[0]);
+    return 1;
+  }
+  if (argc >= 3)
+    iterations = atoi (argv[2]);
+  if (iterations < 1)
+    iterations = 1;
+
+  fd = mkstemp (stats_file);
+  if (fd < 0) {
+    fprintf (stderr, "ERROR: could not create temporary file: %s\n", strerror (errno));
+    return 1;
+  }
+  close (fd);
+
+  without = calloc (iterations, sizeof (run_t));
+  with = calloc (iterations, sizeof (run_t));
+  with_stats = calloc (iterations, sizeof (run_t));
+  cold = calloc (iterations, sizeof (run_t));
+  cold_stats = calloc (iterations, sizeof (run_t));
+
+  /* One untimed run of each, so that both start with warm caches
+   * (page cache, fontconfig, our own layout cache, ...) */
+  if (run_once ("/proc/self/exe", NULL, 0, NULL, &without[0]) < 0 ||
+      run_once ("/proc/self/exe", argv[1], 0, NULL, &with[0]) < 0) {
+    fprintf (stderr, "ERROR: child did not map its window (no display?)\n");
+    unlink (stats_file);
+    return 1;
+  }
+
+  for (i = 0; i < iterations; i++) {
+    if (run_once ("/proc/self/exe", NULL, 0, NULL, &without[i]) < 0 ||
+        run_once ("/proc/self/exe", argv[1], 0, NULL, &with[i]) < 0 ||
+        run_once ("/proc/self/exe", argv[1], 0, stats_file, &with_stats[i]) < 0 ||
+        run_once ("/proc/self/exe", argv[1], 1, NULL, &cold[i]) < 0 ||
+        run_once ("/proc/self/exe", argv[1], 1, stats_file, &cold_stats[i]) < 0) {
+      fprintf (stderr, "ERROR: child did not map its window\n");
+      unlink (stats_file);
+      return 1;
+    }
+  }
+  unlink (stats_file);
+
+  report ("none", without, without, iterations, &median_without);
+  report ("gtk3-nocsd", with, with_stats, iterations, &median_with);
+  report ("gtk3-nocsd-no-cache", cold, cold_stats, iterations, &median_cold);
+  printf ("{\"benchmark\": \"startup_delta\", \"iterations\": %d, \"p50_delta_ns\": %.0f, \"p50_no_cache_delta_ns\": %.0f}\n",
+          iterations, median_with - median_without, median_cold - median_without);
+  return 0;
+}
@@ -0,0 +1,95 @@
+/*
+    gtk3-nocsd, a module used to disable GTK+3 client side decoration.
+
+    Rewriting of decoration layouts (such as "menu:minimize,maximize,close"),
+    shared between the library and its tests.
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef GTK3_NOCSD_DECORATION_LAYOUT_H
+#define GTK3_NOCSD_DECORATION_LAYOUT_H
+
+#include <string.h>
+
+/* Size of the buffer the rewritten layout is stored in (including the
+ * terminating NUL). */
+#define DECORATION_LAYOUT_SIZE 256
+
+/* The standard window buttons, which we remove, as opposed to custom
+ * stuff (such as the application menu), which we retain. */
+static inline int is_window_button (const char *token, size_t length)
+{
+    switch (length) {
+    case 4:
+        return memcmp (token, "icon", 4) == 0;
+    case 5:
+        return memcmp (token, "close", 5) == 0;
+    case 8:
+        return memcmp (token, "minimize", 8) == 0 || memcmp (token, "maximize", 8) == 0;
+    default:
+        return 0;
+    }
+}
+
+/* Write old_layout without any of the standard window buttons to
+ * new_layout (DECORATION_LAYOUT_SIZE bytes), in a single pass and
+ * without allocating anything. The layout is split at the first ':'
+ * only, the sides are split at every ','. Empty entries are kept as
+ * they are.
+ *
+ * Returns 0 on success and -1 if the result doesn't fit (the contents
+ * of new_layout are undefined then). */
+static inline int remove_buttons_from_layout (char *new_layout, const char *old_layout)
+{
+    const char *token = old_layout;
+    const char *p;
+    size_t out = 0;
+    size_t length;
+    int after_colon = 0;
+    int kept = 0;
+
+    for (p = old_layout; ; p++) {
+        if (*p != '\0' && *p != ',' && (*p != ':' || after_colon))
+            continue;
+
+        length = (size_t) (p - token);
+        if (!is_window_button (token, length)) {
+            if (out + (kept ? 1 : 0) + length >= DECORATION_LAYOUT_SIZE)
+                return -1;
+            if (kept)
+                new_layout[out++] = ',';
+            memcpy (new_layout + out, token, length);
+            out += length;
+            kept = 1;
+        }
+
+        if (*p == '\0')
+            break;
+        if (*p == ':') {
+            if (out + 1 >= DECORATION_LAYOUT_SIZE)
+                return -1;
+            new_layout[out++] = ':';
+            after_colon = 1;
+            kept = 0;
+        }
+        token = p + 1;
+    }
+
+    new_layout[out] = '\0';
+    return 0;
+}
+
+#endif /* GTK3_NOCSD_DECORATION_LAYOUT_H */
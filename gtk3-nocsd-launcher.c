@@ -0,0 +1,349 @@
+/*
+    gtk3-nocsd, a module used to disable GTK+3 client side decoration.
+
+    gtk3-nocsd launcher: run an application with libgtk3-nocsd.so.0
+    preloaded. This does exactly what the original wrapper script
+    (gtk3-nocsd.in) did, but without running any other programs, so
+    that starting an application through it doesn't cost more than a
+    single additional execve().
+
+    Usage: ln -s /path/to/gtk3-nocsd ~/bin/evince
+    Or:    gtk3-nocsd evince
+
+    When called through a symlink, the first matching executable in the
+    PATH that is *not* a symlink to gtk3-nocsd is run. When called
+    directly, the program given as its first argument is run.
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Where the library was installed, set by the Makefile. */
+#ifndef LIBDIR
+#define LIBDIR "/usr/local/lib"
+#endif
+
+#define GTK3_NOCSD_NAME "libgtk3-nocsd.so.0"
+#define LAUNCHER_NAME   "gtk3-nocsd"
+
+static const char *system_paths[] = {
+    "/sbin", "/bin", "/usr/bin", "/usr/sbin", "/usr/local/bin", "/usr/local/sbin", NULL
+};
+
+/* Where the dynamic linker looks for a library given by name if it is
+ * neither in LD_LIBRARY_PATH nor in /etc/ld.so.cache. */
+static const char *trusted_library_dirs[] = {
+    "/lib64", "/usr/lib64", "/lib", "/usr/lib", NULL
+};
+
+static const char *base_name (const char *path)
+{
+    const char *slash = strrchr (path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static int is_system_path (const char *dir)
+{
+    const char **p;
+    for (p = system_paths; *p; p++) {
+        if (strcmp (dir, *p) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int is_executable_file (const char *path)
+{
+    struct stat st;
+    return stat (path, &st) == 0 && S_ISREG (st.st_mode) && access (path, X_OK) == 0;
+}
+
+static int library_in_dir (const char *dir, size_t len, const char *name)
+{
+    char path[PATH_MAX];
+
+    /* An empty entry is the current directory */
+    if (len == 0) {
+        dir = ".";
+        len = 1;
+    }
+    return (size_t) snprintf (path, sizeof (path), "%.*s/%s", (int) len, dir, name) < sizeof (path) &&
+           access (path, F_OK) == 0;
+}
+
+/* /etc/ld.so.cache as written by ldconfig since glibc 2.32 (older ones
+ * put it after a table in the old format, see library_in_ld_so_cache).
+ * key and value are offsets of the name of a library and of its full
+ * path, counted from the start of the header. */
+#define LD_SO_CACHE_OLD_MAGIC "ld.so-1.7.0"
+#define LD_SO_CACHE_NEW_MAGIC "glibc-ld.so.cache1.1"
+
+typedef struct ld_so_cache_header_t {
+    char magic[sizeof (LD_SO_CACHE_NEW_MAGIC) - 1];
+    uint32_t nlibs;
+    uint32_t len_strings;
+    uint8_t flags;
+    uint8_t padding[3];
+    uint32_t extension_offset;
+    uint32_t unused[3];
+} ld_so_cache_header_t;
+
+typedef struct ld_so_cache_entry_t {
+    int32_t flags;
+    uint32_t key, value;
+    uint32_t osversion;
+    uint64_t hwcap;
+} ld_so_cache_entry_t;
+
+/* The flags of the libraries the dynamic linker of this architecture
+ * can load; where they aren't known, any library will do. */
+#if defined(__x86_64__) && defined(__LP64__)
+#define LD_SO_CACHE_FLAGS 0x0303
+#elif defined(__i386__)
+#define LD_SO_CACHE_FLAGS 0x0003
+#elif defined(__aarch64__) && defined(__LP64__)
+#define LD_SO_CACHE_FLAGS 0x0a03
+#endif
+
+/* Whether /etc/ld.so.cache has an entry for name. */
+static int library_in_ld_so_cache (const char *name)
+{
+    size_t name_len = strlen (name);
+    const ld_so_cache_header_t *header;
+    const ld_so_cache_entry_t *entry;
+    const char *data, *strings;
+    struct stat st;
+    size_t offset = 0, size, i;
+    int fd, found = 0;
+
+    fd = open ("/etc/ld.so.cache", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (ld_so_cache_header_t) ||
+        (data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close (fd);
+        return 0;
+    }
+    close (fd);
+    size = (size_t) st.st_size;
+
+    /* Skip the table in the old format (a 16 byte header and 12 bytes
+     * per entry), the new one follows it, aligned to 8 bytes. */
+    if (memcmp (data, LD_SO_CACHE_OLD_MAGIC, sizeof (LD_SO_CACHE_OLD_MAGIC) - 1) == 0)
+        offset = (16 + (size_t) *(const uint32_t *) (data + 12) * 12 + 7) & ~(size_t) 7;
+
+    header = (const ld_so_cache_header_t *) (data + offset);
+    if (offset + sizeof (*header) <= size &&
+        memcmp (header->magic, LD_SO_CACHE_NEW_MAGIC, sizeof (header->magic)) == 0 &&
+        header->nlibs <= (size - offset - sizeof (*header)) / sizeof (*entry)) {
+        strings = (const char *) header;
+        entry = (const ld_so_cache_entry_t *) (header + 1);
+        for (i = 0; i < header->nlibs && !found; i++, entry++) {
+#ifdef LD_SO_CACHE_FLAGS
+            if (entry->flags != LD_SO_CACHE_FLAGS)
+                continue;
+#endif
+            found = entry->key < size - offset && size - offset - entry->key > name_len &&
+                    memcmp (strings + entry->key, name, name_len + 1) == 0;
+        }
+    }
+    munmap ((void *) data, size);
+    return found;
+}
+
+/* Whether the dynamic linker finds name without a path: look where it
+ * looks, in the same order. */
+static int library_found_by_name (const char *name)
+{
+    const char *search = getenv ("LD_LIBRARY_PATH");
+    const char *dir, *end;
+    const char **p;
+
+    if (search && *search) {
+        for (dir = search; ; dir = end + 1) {
+            end = dir + strcspn (dir, ":;");
+            if (library_in_dir (dir, (size_t) (end - dir), name))
+                return 1;
+            if (*end == '\0')
+                break;
+        }
+    }
+    if (library_in_ld_so_cache (name))
+        return 1;
+    for (p = trusted_library_dirs; *p; p++) {
+        if (library_in_dir (*p, strlen (*p), name))
+            return 1;
+    }
+    return 0;
+}
+
+/* Determine what to put into LD_PRELOAD. binary_dir is the directory
+ * the launcher is installed in (with all symlinks resolved). */
+static const char *find_library (const char *binary_dir)
+{
+    static char path[PATH_MAX];
+    char prefix_lib[PATH_MAX];
+    const char *dirs[3];
+    size_t len;
+    int i;
+
+    /* If both the launcher and the library are in the system path, use
+     * the plain library name, so that the dynamic linker picks the
+     * right one for every architecture the library is installed for.
+     * Whether the dynamic linker finds the library by name is checked
+     * without loading it, which would run its constructors (reading
+     * the policy, resolving symbols, ...) in the launcher, or running
+     * another program with it preloaded, as the old script did. */
+    if (is_system_path (binary_dir) && library_found_by_name (GTK3_NOCSD_NAME))
+        return GTK3_NOCSD_NAME;
+
+    /* Otherwise try the directory the library was installed to when
+     * building gtk3-nocsd, then the directory of the launcher, then
+     * the lib directory next to it. */
+    len = strlen (binary_dir);
+    if (len >= 4 && strcmp (binary_dir + len - 4, "/bin") == 0)
+        len -= 4;
+    snprintf (prefix_lib, sizeof (prefix_lib), "%.*s/lib", (int) len, binary_dir);
+
+    dirs[0] = LIBDIR;
+    dirs[1] = binary_dir;
+    dirs[2] = prefix_lib;
+    for (i = 0; i < 3; i++) {
+        if ((size_t) snprintf (path, sizeof (path), "%s/%s", dirs[i], GTK3_NOCSD_NAME) < sizeof (path) &&
+            access (path, F_OK) == 0)
+            return path;
+    }
+
+    /* This will _probably_ not work (unless the library is installed
+     * in a system path, but the launcher wasn't), but at least the user
+     * will get a useful error message. */
+    return GTK3_NOCSD_NAME;
+}
+
+/* Find the real program: the first executable called name in the PATH
+ * that doesn't resolve to the launcher itself. */
+static const char *find_program (const char *name)
+{
+    static char path[PATH_MAX];
+    char resolved[PATH_MAX];
+    const char *search = getenv ("PATH");
+    const char *dir, *end;
+    size_t len;
+
+    if (!search)
+        search = "/bin:/usr/bin";
+
+    for (dir = search; ; dir = end + 1) {
+        end = strchrnul (dir, ':');
+        len = (size_t) (end - dir);
+        /* An empty entry is the current directory */
+        if (len == 0) {
+            dir = ".";
+            len = 1;
+        }
+        if ((size_t) snprintf (path, sizeof (path), "%.*s/%s", (int) len, dir, name) < sizeof (path) &&
+            is_executable_file (path) &&
+            realpath (path, resolved) &&
+            strcmp (base_name (resolved), LAUNCHER_NAME) != 0)
+            return path;
+        if (*end == '\0')
+            break;
+    }
+    return NULL;
+}
+
+static void set_environment (const char *library)
+{
+    const char *old_preload = getenv ("LD_PRELOAD");
+    char *preload;
+
+    if (old_preload && *old_preload) {
+        if (asprintf (&preload, "%s:%s", library, old_preload) < 0) {
+            fprintf (stderr, "%s: out of memory\n", LAUNCHER_NAME);
+            exit (1);
+        }
+        setenv ("LD_PRELOAD", preload, 1);
+        free (preload);
+    } else {
+        setenv ("LD_PRELOAD", library, 1);
+    }
+    setenv ("GTK_CSD", "0", 1);
+}
+
+static int exec_failed (const char *program)
+{
+    int saved_errno = errno;
+    fprintf (stderr, "%s: %s: %s\n", LAUNCHER_NAME, program, strerror (saved_errno));
+    return saved_errno == ENOENT ? 127 : 126;
+}
+
+int main (int argc, char **argv)
+{
+    char binary[PATH_MAX];
+    const char *library;
+    const char *appname;
+    const char *apppath;
+    char *slash;
+
+    /* Where we are installed, with all symlinks resolved */
+    if (!realpath ("/proc/self/exe", binary))
+        binary[0] = '\0';
+    slash = strrchr (binary, '/');
+    if (slash)
+        *slash = '\0';
+    library = find_library (binary);
+
+    appname = base_name (argv[0]);
+
+    /* This program was called directly, instead of via a symlink. */
+    if (strcmp (appname, LAUNCHER_NAME) == 0) {
+        if (argc < 2)
+            return 0;
+        if (strcmp (argv[1], "-h") == 0 || strcmp (argv[1], "--help") == 0) {
+            printf ("Usage: %s program [args]\n", argv[0]);
+            return 0;
+        }
+
+        set_environment (library);
+        execvp (argv[1], argv + 1);
+        return exec_failed (argv[1]);
+    }
+
+    apppath = find_program (appname);
+    if (!apppath) {
+        if (strcmp (appname, "false") != 0) {
+            fprintf (stderr, "%s: %s: not found\n", LAUNCHER_NAME, appname);
+            return 127;
+        }
+        apppath = "/bin/false";
+    }
+
+    /* Run the program with CSD disabled */
+    set_environment (library);
+    argv[0] = (char *) apppath;
+    execv (apppath, argv);
+    return exec_failed (apppath);
+}
@@ -29,6 +29,15 @@
 
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stddef.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include <stdarg.h>
 
@@ -37,11 +46,32 @@
 
 #include <girffi.h>
 
-#include <gobject/gvaluecollector.h>
+#include "decoration-layout.h"
+
+/* If built for a specific Gtk+3 version (make GTK_TARGET=3.24), all
+ * version checks are resolved at compile time and code that is only
+ * needed for older versions is left out. The library then refuses to
+ * do anything if the Gtk+3 it finds at runtime is older than that. */
+#define GTK3_NOCSD_VERSION_NUMBER(major, minor, micro) ((major) * 1000000 + (minor) * 1000 + (micro))
+#ifdef GTK3_NOCSD_TARGET_MAJOR
+#define GTK3_NOCSD_TARGET_AT_LEAST(major, minor, micro) \
+    (GTK3_NOCSD_VERSION_NUMBER(GTK3_NOCSD_TARGET_MAJOR, GTK3_NOCSD_TARGET_MINOR, GTK3_NOCSD_TARGET_MICRO) >= \
+     GTK3_NOCSD_VERSION_NUMBER(major, minor, micro))
+#define GTK_AT_LEAST(major, minor, micro) GTK3_NOCSD_TARGET_AT_LEAST(major, minor, micro)
+#if !GTK3_NOCSD_TARGET_AT_LEAST(3, 10, 0)
+#error "GTK_TARGET must be 3.10 or newer"
+#endif
+#else
+#define GTK3_NOCSD_TARGET_AT_LEAST(major, minor, micro) 0
+#define GTK_AT_LEAST(major, minor, micro) ((gtk_capabilities () & GTK_CAP_ ## major ## _ ## minor ## _ ## micro) != 0)
+#endif
+
+/* Before 3.16.1 CSD are prevented by making Gtk believe that there
+ * is no compositor while a window is realized. */
+#define NEED_COMPOSITE_HACK (!GTK3_NOCSD_TARGET_AT_LEAST(3, 16, 1))
 
 typedef void (*gtk_window_buildable_add_child_t) (GtkBuildable *buildable, GtkBuilder *builder, GObject *child, const gchar *type);
 typedef GObject* (*gtk_dialog_constructor_t) (GType type, guint n_construct_properties, GObjectConstructParam *construct_params);
-typedef char *(*gtk_check_version_t) (guint required_major, guint required_minor, guint required_micro);
 typedef void (*gtk_header_bar_set_property_t) (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
 typedef void (*gtk_header_bar_realize_t) (GtkWidget *widget);
 typedef void (*gtk_header_bar_unrealize_t) (GtkWidget *widget);
@@ -96,43 +126,187 @@ static const char *library_sonames_v2[NUM_LIBRARIES] = {
     NULL
 };
 
-static void * volatile library_handles[NUM_LIBRARIES * 2] = {
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL
-};
+/* Libraries we had to dlopen() ourselves, see library_handle(). */
+static void *library_handles[NUM_LIBRARIES * 2];
+static unsigned long library_handle_misses[NUM_LIBRARIES * 2];
 
 static pthread_key_t key_tls;
 static pthread_once_t key_tls_once = PTHREAD_ONCE_INIT;
+static volatile int key_tls_created = 0;
+
+/* What the Gtk+ version in use can do, see gtk_capabilities(). Every
+ * version that GTK_AT_LEAST() is used with needs a flag here. Marking
+ * both as volatile here saves the trouble of caring about memory
+ * barriers. */
+enum {
+    GTK_CAP_KNOWN      = 1 << 0,
+    GTK_CAP_COMPATIBLE = 1 << 1,
+    GTK_CAP_3_12_0     = 1 << 2,
+    GTK_CAP_3_16_1     = 1 << 3
+};
 
-/* Marking both as volatile here saves the trouble of caring about
- * memory barriers. */
-static volatile gboolean is_compatible_gtk_version_cached = FALSE;
-static volatile gboolean is_compatible_gtk_version_checked = FALSE;
+static volatile int gtk_capabilities_cached = 0;
 static volatile int gtk2_active;
 
+/* A signal handler to capture while probing (see begin_signal_capture):
+ * the callback of the last connection of the signal name on instance
+ * (or with data as user data) is stored in callback. */
+typedef struct signal_capture_t {
+    const char *name;
+    gpointer instance;
+    gpointer data;
+    GCallback callback;
+} signal_capture_t;
+
 typedef struct gtk3_nocsd_tls_data_t {
+#if NEED_COMPOSITE_HACK
   // When set to true, this override gdk_screen_is_composited() and let it
   // return FALSE temporarily. Then, client-side decoration (CSD) cannot be initialized.
   volatile int disable_composite;
-  volatile int signal_capture_handler;
+#endif
+  volatile int signal_capture_count;
   volatile int fake_global_decoration_layout;
   volatile int in_info_collect;
-  const char *volatile  signal_capture_name;
-  volatile gpointer signal_capture_instance;
-  volatile gpointer signal_capture_data;
-  volatile GCallback signal_capture_callback;
+  signal_capture_t *volatile signal_captures;
+  struct gtk3_nocsd_hook_stats_t *hook_stats;
 } gtk3_nocsd_tls_data_t;
 
+/* Per-thread state is allocated the first time a thread changes any of
+ * it (TLSD). Code that only wants to know whether anything is set uses
+ * TLSD_PEEK, which never allocates and falls back to an all-zero
+ * instance, so threads that never take part in any of the hacks don't
+ * pay for anything beyond a pthread_getspecific(). */
+static const gtk3_nocsd_tls_data_t tls_data_empty;
+
 static gtk3_nocsd_tls_data_t *tls_data_location();
-#define TLSD     (tls_data_location())
+
+static inline const gtk3_nocsd_tls_data_t *tls_data_peek()
+{
+    const gtk3_nocsd_tls_data_t *ptr;
+
+    if (G_UNLIKELY (!__atomic_load_n (&key_tls_created, __ATOMIC_ACQUIRE)))
+        return &tls_data_empty;
+    ptr = pthread_getspecific (key_tls);
+    return G_LIKELY (ptr == NULL) ? &tls_data_empty : ptr;
+}
+
+#define TLSD      (tls_data_location())
+#define TLSD_PEEK (tls_data_peek())
+
+/* Statistics (GTK3_NOCSD_STATS) */
+static int stats_enabled;
+
+static unsigned long long monotonic_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+/* Number of calls and time spent in each of our hooks. Every thread
+ * counts into a block of its own, so the hooks don't contend on a
+ * shared cache line. The blocks are linked into a list that is only
+ * ever prepended to (the block of a thread that exited is reused by
+ * the next thread that needs one), so the list can be walked from a
+ * signal handler without taking a lock. */
+#define HOOK_STATS(X) \
+    X(g_object_get) \
+    X(g_object_get_fake_layout) \
+    X(g_signal_connect_data) \
+    X(gtk_window_set_titlebar) \
+    X(gtk_header_bar_set_show_close_button) \
+    X(gtk_header_bar_set_decoration_layout) \
+    X(update_window_buttons) \
+    X(gdk_screen_is_composited) \
+    X(gdk_window_set_decorations) \
+    X(detect_gtk2_walk) \
+    X(find_orig_function_dlopen)
+
+#define HOOK_STATS_ENUM(name) HOOK_ ## name,
+#define HOOK_STATS_NAME(name) #name,
+
+enum {
+    HOOK_STATS(HOOK_STATS_ENUM)
+    NUM_HOOKS
+};
+
+static const char *hook_names[NUM_HOOKS] = {
+    HOOK_STATS(HOOK_STATS_NAME)
+};
+
+typedef struct gtk3_nocsd_hook_stats_t {
+    struct gtk3_nocsd_hook_stats_t *next;
+    volatile int in_use;
+    volatile unsigned long calls[NUM_HOOKS];
+    volatile unsigned long long ticks[NUM_HOOKS];
+} gtk3_nocsd_hook_stats_t;
+
+static gtk3_nocsd_hook_stats_t *hook_stats_list = NULL;
+static volatile unsigned long hook_stats_blocks = 0;
+
+/* The time stamp counter where we have one (cycles), nanoseconds
+ * everywhere else. */
+#if defined(__x86_64__) || defined(__i386__)
+#define HOOK_TICKS_UNIT "tsc"
+static inline unsigned long long hook_ticks ()
+{
+    return __builtin_ia32_rdtsc ();
+}
+#else
+#define HOOK_TICKS_UNIT "ns"
+static inline unsigned long long hook_ticks ()
+{
+    return monotonic_ns ();
+}
+#endif
+
+static gtk3_nocsd_hook_stats_t *hook_stats_acquire ()
+{
+    gtk3_nocsd_hook_stats_t *block;
+    int expected;
+
+    for (block = __atomic_load_n (&hook_stats_list, __ATOMIC_ACQUIRE); block; block = block->next) {
+        expected = 0;
+        if (__atomic_compare_exchange_n (&block->in_use, &expected, 1, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return block;
+    }
+
+    /* Never freed, see above. */
+    block = calloc (1, sizeof (gtk3_nocsd_hook_stats_t));
+    if (!block)
+        return NULL;
+    block->in_use = 1;
+    block->next = __atomic_load_n (&hook_stats_list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&hook_stats_list, &block->next, block, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    __sync_fetch_and_add (&hook_stats_blocks, 1);
+    return block;
+}
+
+static void hook_stats_record (int hook, unsigned long long ticks)
+{
+    gtk3_nocsd_tls_data_t *tls = TLSD;
+
+    if (G_UNLIKELY (!tls->hook_stats)) {
+        tls->hook_stats = hook_stats_acquire ();
+        if (!tls->hook_stats)
+            return;
+    }
+    /* Only this thread ever writes to the block. */
+    tls->hook_stats->calls[hook]++;
+    tls->hook_stats->ticks[hook] += ticks;
+}
+
+static inline unsigned long long hook_timer_start ()
+{
+    return G_UNLIKELY (stats_enabled) ? hook_ticks () : 0;
+}
+
+static inline void hook_timer_stop (int hook, unsigned long long start)
+{
+    if (G_UNLIKELY (start))
+        hook_stats_record (hook, hook_ticks () - start);
+}
 
 __attribute__((destructor)) static void cleanup_library_handles(void) {
     int i;
@@ -143,6 +317,70 @@ __attribute__((destructor)) static void cleanup_library_handles(void) {
     }
 }
 
+static int link_map_generation_callback(struct dl_phdr_info *info, size_t size, void *data)
+{
+    unsigned long long *generation = data;
+
+    /* glibc < 2.4 */
+    if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+        return -1;
+    generation[0] = info->dlpi_adds;
+    generation[1] = info->dlpi_subs;
+    return 1;
+}
+
+/* Number of objects the dynamic linker has loaded so far, 0 if we
+ * can't tell. */
+static unsigned long link_map_adds()
+{
+    unsigned long long generation[2];
+
+    if (dl_iterate_phdr(link_map_generation_callback, generation) != 1)
+        return 0;
+    return (unsigned long) generation[0];
+}
+
+/* Get a reference to an already loaded library (RTLD_NOLOAD, since we
+ * don't want to mask problems if plugins aren't properly linked
+ * against gtk itself), index being the library id, plus NUM_LIBRARIES
+ * for the gtk2 variants. We keep that reference so that we may close
+ * it again in a destructor function once we are unloaded.
+ *
+ * There is no lock: a handle is published exactly once, and a thread
+ * that loses the race to publish its own drops its reference again,
+ * so that we never hold more than one. If the library isn't loaded,
+ * we remember how many objects had been loaded by then and don't try
+ * again before anything new shows up. */
+static void *library_handle(int index, const char *soname)
+{
+    void *handle = __atomic_load_n(&library_handles[index], __ATOMIC_ACQUIRE);
+    void *published = NULL;
+    unsigned long adds;
+    unsigned long long start;
+
+    if (G_LIKELY(handle != NULL))
+        return handle;
+
+    adds = link_map_adds();
+    if (adds && __atomic_load_n(&library_handle_misses[index], __ATOMIC_RELAXED) == adds)
+        return NULL;
+
+    start = hook_timer_start ();
+    handle = dlopen(soname, RTLD_LAZY | RTLD_NOLOAD);
+    hook_timer_stop (HOOK_find_orig_function_dlopen, start);
+    if (!handle) {
+        __atomic_store_n(&library_handle_misses[index], adds, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    if (!__atomic_compare_exchange_n(&library_handles[index], &published, handle, FALSE,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        (void) dlclose(handle);
+        handle = published;
+    }
+    return handle;
+}
+
 static void *find_orig_function(int try_gtk2, int library_id, const char *symbol) {
     void *handle;
     void *symptr;
@@ -160,33 +398,13 @@ static void *find_orig_function(int try_gtk2, int library_id, const char *symbol
 
     /* dlsym(RTLD_NEXT, ...) will fail if the library using the symbol
      * is dlopen()d itself (e.g. a python module or similar), so what
-     * we need to do is load the corresponding library ourselves and
-     * look for the symbol there. We keep a reference to that library
-     * so that we may close it again in a destructor function once we
-     * are unloaded. dlopen()/dlclose() are refcounted, so we need to
-     * use a mutex to protect dlopen(), otherwise we possibly could
-     * take out more than one reference on the library and the cleanup
-     * function wouldn't completely free it.
-     *
-     * Note that we use RTLD_NOLOAD, since we don't want to mask
-     * problems if plugins aren't properly linked against gtk itself. */
-    handle = library_handles[library_id];
-
+     * we need to do is get a handle of the corresponding library
+     * ourselves and look for the symbol there. */
+    handle = library_handle(library_id, library_sonames[library_id]);
     if (!handle) {
-        static pthread_mutex_t handle_mutex = PTHREAD_MUTEX_INITIALIZER;
-        pthread_mutex_lock(&handle_mutex);
-        /* we need to check again inside the mutex-protected block */
-        handle = library_handles[library_id];
-        if (!handle)
-            handle = dlopen(library_sonames[library_id], RTLD_LAZY | RTLD_NOLOAD);
-        if (handle)
-            library_handles[library_id] = handle;
-        pthread_mutex_unlock(&handle_mutex);
-        if (!handle) {
-            if (try_gtk2)
-                goto try_gtk2_version;
-            return NULL;
-        }
+        if (try_gtk2)
+            goto try_gtk2_version;
+        return NULL;
     }
 
     symptr = dlsym(handle, symbol);
@@ -212,104 +430,756 @@ try_gtk2_version:
     if (!library_sonames_v2[library_id])
         return NULL;
 
-    /* Same logic as above, but we use an offset in the library
-     * handles and use the v2 soname. */
-    handle = library_handles[NUM_LIBRARIES + library_id];
-    if (!handle) {
-        static pthread_mutex_t handle_v2_mutex = PTHREAD_MUTEX_INITIALIZER;
-        pthread_mutex_lock(&handle_v2_mutex);
-        /* we need to check again inside the mutex-protected block */
-        handle = library_handles[NUM_LIBRARIES + library_id];
-        if (!handle)
-            handle = dlopen(library_sonames_v2[library_id], RTLD_LAZY | RTLD_NOLOAD);
-        if (handle)
-            library_handles[NUM_LIBRARIES + library_id] = handle;
-        pthread_mutex_unlock(&handle_v2_mutex);
-        if (!handle)
-            return NULL;
-    }
+    handle = library_handle(NUM_LIBRARIES + library_id, library_sonames_v2[library_id]);
+    if (!handle)
+        return NULL;
 
     return dlsym(handle, symbol);
 }
 
+#define HIDDEN_NAME2(a,b)   a ## b
+#define NAME2(a,b)          HIDDEN_NAME2(a,b)
+
+#define RUNTIME_IMPORTS(IMPORT) \
+    IMPORT(0, GTK_LIBRARY, gtk_css_provider_new, GtkCssProvider *, (), ()) \
+    IMPORT(0, GTK_LIBRARY, gtk_css_provider_load_from_data, void, (GtkCssProvider *provider, const gchar *data, gssize length, GError **error), (provider, data, length, error)) \
+    IMPORT(0, GTK_LIBRARY, gtk_window_new, GtkWidget *, (GtkWindowType type), (type)) \
+    IMPORT(0, GTK_LIBRARY, gtk_header_bar_new, GtkWidget *, (), ()) \
+    IMPORT(0, GTK_LIBRARY, gtk_window_get_type, GType, (), ()) \
+    IMPORT(0, GTK_LIBRARY, gtk_header_bar_get_type, GType, (), ()) \
+    IMPORT(0, GTK_LIBRARY, gtk_window_get_titlebar, GtkWidget *, (GtkWindow *window), (window)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_get_type, GType, (), ()) \
+    IMPORT(0, GTK_LIBRARY, gtk_buildable_get_type, GType, (), ()) \
+    IMPORT(0, GTK_LIBRARY, gtk_window_set_titlebar, void, (GtkWindow *window, GtkWidget *titlebar), (window, titlebar)) \
+    IMPORT(0, GTK_LIBRARY, gtk_header_bar_set_show_close_button, void, (GtkHeaderBar *bar, gboolean setting), (bar, setting)) \
+    IMPORT(0, GTK_LIBRARY, gtk_header_bar_set_decoration_layout, void, (GtkHeaderBar *bar, const gchar *layout), (bar, layout)) \
+    IMPORT(0, GTK_LIBRARY, gtk_header_bar_get_decoration_layout, const gchar *, (GtkHeaderBar *bar), (bar)) \
+    IMPORT(0, GTK_LIBRARY, gtk_style_context_add_class, void, (GtkStyleContext *context, const gchar *class_name), (context, class_name)) \
+    IMPORT(0, GTK_LIBRARY, gtk_style_context_remove_class, void, (GtkStyleContext *context, const gchar *class_name), (context, class_name)) \
+    IMPORT(0, GTK_LIBRARY, gtk_style_context_add_provider_for_screen, void, (GdkScreen *screen, GtkStyleProvider *provider, guint priority), (screen, provider, priority)) \
+    IMPORT(0, GTK_LIBRARY, gtk_style_provider_get_type, GType, (), ()) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_destroy, void, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_get_mapped, gboolean, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_get_realized, gboolean, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_get_style_context, GtkStyleContext *, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_get_screen, GdkScreen *, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_map, void, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_set_parent, void, (GtkWidget *widget, GtkWidget *parent), (widget, parent)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_unrealize, void, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_realize, void, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_get_settings, GtkSettings *, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GTK_LIBRARY, gtk_widget_get_toplevel, GtkWidget *, (GtkWidget *widget), (widget)) \
+    IMPORT(0, GDK_LIBRARY, gdk_window_get_user_data, void, (GdkWindow *window, gpointer *data), (window, data)) \
+    IMPORT(1, GDK_LIBRARY, gdk_screen_is_composited, gboolean, (GdkScreen *screen), (screen)) \
+    IMPORT(1, GDK_LIBRARY, gdk_window_set_decorations, void, (GdkWindow *window, GdkWMDecoration decorations), (window, decorations)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_object_get_qdata, gpointer, (GObject *object, GQuark quark), (object, quark)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_object_set_qdata, void, (GObject *object, GQuark quark, gpointer data), (object, quark, data)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_object_set_qdata_full, void, (GObject *object, GQuark quark, gpointer data, GDestroyNotify destroy), (object, quark, data, destroy)) \
+    IMPORT(0, GLIB_LIBRARY, g_quark_from_static_string, GQuark, (const gchar *string), (string)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_object_ref, gpointer, (gpointer object), (object)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_object_unref, void, (gpointer object), (object)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_check_class_cast, GTypeClass *, (GTypeClass *g_class, GType is_a_type), (g_class, is_a_type)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_class_peek_parent, gpointer, (gpointer g_class), (g_class)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_check_instance_is_a, gboolean, (GTypeInstance *instance, GType iface_type), (instance, iface_type)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_check_instance_cast, GTypeInstance *, (GTypeInstance *instance, GType iface_type), (instance, iface_type)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_object_class_find_property, GParamSpec *, (GObjectClass *oclass, const gchar *property_name), (oclass, property_name)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_register_static_simple, GType, (GType parent_type, const gchar *type_name, guint class_size, GClassInitFunc class_init, guint instance_size, GInstanceInitFunc instance_init, GTypeFlags flags), (parent_type, type_name, class_size, class_init, instance_size, instance_init, flags)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_add_interface_static, void, (GType instance_type, GType interface_type, const GInterfaceInfo *info), (instance_type, interface_type, info)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_add_instance_private, gint, (GType class_type, gsize private_size), (class_type, private_size)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_instance_get_private, gpointer, (GTypeInstance *instance, GType private_type), (instance, private_type)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_value_table_peek, GTypeValueTable *, (GType type), (type)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_type_check_instance_is_fundamentally_a, gboolean, (GTypeInstance *instance, GType fundamental_type), (instance, fundamental_type)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_signal_connect_data, gulong, (gpointer instance, const gchar *detailed_signal, GCallback c_handler, gpointer data, GClosureNotify destroy_data, GConnectFlags connect_flags), (instance, detailed_signal, c_handler, data, destroy_data, connect_flags)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_signal_handlers_disconnect_matched, guint, (gpointer instance, GSignalMatchType mask, guint signal_id, GQuark detail, GClosure *closure, gpointer func, gpointer data), (instance, mask, signal_id, detail, closure, func, data)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_object_get_valist, void, (GObject *object, const gchar *first_property_name, va_list var_args), (object, first_property_name, var_args)) \
+    IMPORT(0, GOBJECT_LIBRARY, g_value_get_boolean, gboolean, (const GValue *value), (value)) \
+    IMPORT(0, GLIB_LIBRARY, g_getenv, gchar *, (const char *name), (name)) \
+    IMPORT(0, GLIB_LIBRARY, g_logv, void, (const gchar *log_domain, GLogLevelFlags log_level, const gchar *format, va_list args), (log_domain, log_level, format, args)) \
+    IMPORT(0, GLIB_LIBRARY, g_malloc0, gpointer, (gsize n_bytes), (n_bytes)) \
+    IMPORT(0, GLIB_LIBRARY, g_free, void, (gpointer mem), (mem)) \
+    IMPORT(0, GLIB_LIBRARY, g_strdup, gchar *, (const gchar *str), (str)) \
+    IMPORT(0, GLIB_LIBRARY, g_idle_add_full, guint, (gint priority, GSourceFunc function, gpointer data, GDestroyNotify notify), (priority, function, data, notify)) \
+    IMPORT(0, GLIB_LIBRARY, g_assertion_message_expr, void, (const char *domain, const char *file, int line, const char *func, const char *expr), (domain, file, line, func, expr)) \
+    IMPORT(0, GIREPOSITORY_LIBRARY, g_function_info_prep_invoker, gboolean, (GIFunctionInfo *info, GIFunctionInvoker *invoker, GError **error), (info, invoker, error))
+
+/* Every imported function gets an index into a per-library dispatch
+ * table. Instead of calling dlsym() for each function separately the
+ * first time it is used, the table for a library is filled in a single
+ * pass as soon as that library shows up (i.e. either when we are
+ * loaded or when the first function from it is needed), by looking up
+ * all the names directly in the library's dynamic symbol table. */
+#define RUNTIME_IMPORT_ID(try_gtk2, library, function_name, return_type, arg_def_list, arg_use_list) \
+    NAME2(RTLOOKUP_, function_name),
+#define RUNTIME_IMPORT_INFO(try_gtk2, library, function_name, return_type, arg_def_list, arg_use_list) \
+    { try_gtk2, library, #function_name },
+
+enum {
+    RUNTIME_IMPORTS(RUNTIME_IMPORT_ID)
+    NUM_RUNTIME_IMPORTS
+};
+
+typedef struct runtime_import_t {
+    int try_gtk2;
+    int library;
+    const char *name;
+} runtime_import_t;
+
+static const runtime_import_t runtime_imports[NUM_RUNTIME_IMPORTS] = {
+    RUNTIME_IMPORTS(RUNTIME_IMPORT_INFO)
+};
+
+/* The second half holds the Gtk2 variants (library_sonames_v2) of the
+ * functions that have try_gtk2 set. Entries are only written while
+ * holding runtime_import_mutex, but read without it. (They only ever
+ * change from NULL to the address of a function, so there is nothing
+ * to order them against.) */
+static void *runtime_import_table[NUM_RUNTIME_IMPORTS * 2];
+static volatile int runtime_import_library_filled[NUM_LIBRARIES * 2];
+static pthread_mutex_t runtime_import_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct gtk3_nocsd_stats_t {
+    volatile unsigned long symbols_resolved;
+    volatile unsigned long symbols_dlsym_fallback;
+    volatile unsigned long symbols_unresolved;
+    volatile unsigned long libraries_scanned;
+    volatile unsigned long long resolve_ns;
+    /* Startup phases (only measured if statistics are enabled). The
+     * title bar time includes probing and CSS if those happen as part
+     * of gtk_window_set_titlebar. */
+    volatile unsigned long long probe_ns;
+    volatile unsigned long long css_ns;
+    volatile unsigned long long titlebar_ns;
+    volatile unsigned long titlebar_calls;
+} gtk3_nocsd_stats_t;
+
+static gtk3_nocsd_stats_t stats;
+static char *stats_file = NULL;
+
+static inline unsigned long long stats_timer_start ()
+{
+    return G_UNLIKELY (stats_enabled) ? monotonic_ns () : 0;
+}
+
+static inline void stats_timer_stop (volatile unsigned long long *counter, unsigned long long start)
+{
+    if (G_UNLIKELY (start))
+        __sync_fetch_and_add (counter, monotonic_ns () - start);
+}
+
+typedef struct elf_symbol_table_t {
+    ElfW(Addr) base;
+    const ElfW(Sym) *symtab;
+    const char *strtab;
+    const Elf32_Word *gnu_hash;
+    const ElfW(Half) *versym;
+    const char *soname;
+} elf_symbol_table_t;
+
+static ElfW(Addr) elf_dynamic_pointer (ElfW(Addr) base, ElfW(Addr) ptr)
+{
+    /* glibc relocates the address entries of the dynamic section in
+     * place on most architectures, but not for the vDSO and not on
+     * architectures with read-only dynamic sections. */
+    return ptr < base ? ptr + base : ptr;
+}
+
+static int elf_symbol_table_init (elf_symbol_table_t *table, struct dl_phdr_info *info)
+{
+    const ElfW(Dyn) *dyn = NULL;
+    ElfW(Addr) soname_offset = (ElfW(Addr)) -1;
+    ElfW(Half) n;
+
+    memset (table, 0, sizeof (*table));
+    table->base = info->dlpi_addr;
+
+    for (n = 0; n < info->dlpi_phnum; n++) {
+        if (info->dlpi_phdr[n].p_type == PT_DYNAMIC) {
+            dyn = (const ElfW(Dyn) *) (info->dlpi_addr + info->dlpi_phdr[n].p_vaddr);
+            break;
+        }
+    }
+    if (!dyn)
+        return -1;
+
+    for (; dyn->d_tag != DT_NULL; dyn++) {
+        switch (dyn->d_tag) {
+        case DT_STRTAB:
+            table->strtab = (const char *) elf_dynamic_pointer (table->base, dyn->d_un.d_ptr);
+            break;
+        case DT_SYMTAB:
+            table->symtab = (const ElfW(Sym) *) elf_dynamic_pointer (table->base, dyn->d_un.d_ptr);
+            break;
+        case DT_GNU_HASH:
+            table->gnu_hash = (const Elf32_Word *) elf_dynamic_pointer (table->base, dyn->d_un.d_ptr);
+            break;
+        case DT_VERSYM:
+            table->versym = (const ElfW(Half) *) elf_dynamic_pointer (table->base, dyn->d_un.d_ptr);
+            break;
+        case DT_SONAME:
+            soname_offset = dyn->d_un.d_val;
+            break;
+        }
+    }
+    if (!table->strtab || !table->symtab)
+        return -1;
+    if (soname_offset != (ElfW(Addr)) -1)
+        table->soname = table->strtab + soname_offset;
+    return 0;
+}
+
+static void *elf_symbol_table_lookup (const elf_symbol_table_t *table, const char *name)
+{
+    const Elf32_Word *gnu_hash = table->gnu_hash;
+    const ElfW(Addr) *bloom;
+    const Elf32_Word *buckets, *chain;
+    Elf32_Word nbuckets, symoffset, bloom_size, bloom_shift;
+    Elf32_Word hash = 5381, symix;
+    ElfW(Addr) word, mask;
+    const unsigned char *c;
+    const unsigned int bits = sizeof (ElfW(Addr)) * 8;
+
+    if (!gnu_hash)
+        return NULL;
+
+    for (c = (const unsigned char *) name; *c; c++)
+        hash = hash * 33 + *c;
+
+    nbuckets = gnu_hash[0];
+    symoffset = gnu_hash[1];
+    bloom_size = gnu_hash[2];
+    bloom_shift = gnu_hash[3];
+    bloom = (const ElfW(Addr) *) &gnu_hash[4];
+    buckets = (const Elf32_Word *) &bloom[bloom_size];
+    chain = &buckets[nbuckets];
+
+    if (nbuckets == 0 || bloom_size == 0)
+        return NULL;
+
+    word = bloom[(hash / bits) % bloom_size];
+    mask = ((ElfW(Addr)) 1 << (hash % bits)) | ((ElfW(Addr)) 1 << ((hash >> bloom_shift) % bits));
+    if ((word & mask) != mask)
+        return NULL;
+
+    symix = buckets[hash % nbuckets];
+    if (symix < symoffset)
+        return NULL;
+
+    for (;; symix++) {
+        const ElfW(Sym) *sym = &table->symtab[symix];
+        Elf32_Word chain_hash = chain[symix - symoffset];
+
+        if ((hash | 1) == (chain_hash | 1)
+            && strcmp (name, table->strtab + sym->st_name) == 0
+            && sym->st_shndx != SHN_UNDEF
+            && ELF32_ST_TYPE (sym->st_info) == STT_FUNC
+            /* hidden (non-default) symbol versions */
+            && !(table->versym && (table->versym[symix] & 0x8000)))
+            return (void *) (table->base + sym->st_value);
+
+        if (chain_hash & 1)
+            break;
+    }
+    return NULL;
+}
+
+#if __ELF_NATIVE_CLASS == 64
+#define ELF_R_SYM(info)     ELF64_R_SYM (info)
+#else
+#define ELF_R_SYM(info)     ELF32_R_SYM (info)
+#endif
+
+/* Some functions are only exported by us during the startup phase of
+ * a program. Once they aren't needed anymore, the GOT entries of
+ * the libraries calling them can be pointed back to the original
+ * function, so that the interposer is completely bypassed. Only slots
+ * that are already bound to our function are touched; slots that are
+ * still lazily bound (and libraries that are loaded later) will still
+ * end up calling us, which is harmless. */
+typedef struct rebind_request_t {
+    const char *name;
+    void *from;
+    void *to;
+    unsigned long rebound;
+} rebind_request_t;
+
+static uintptr_t rebind_page_size ()
+{
+    static uintptr_t page_size = 0;
+    if (!page_size)
+        page_size = (uintptr_t) sysconf (_SC_PAGESIZE);
+    return page_size;
+}
+
+/* relro_start and relro_end are the page aligned bounds of what the
+ * dynamic linker made read-only after relocating (a partial last page
+ * of PT_GNU_RELRO stays writable, because it usually holds .got.plt or
+ * .data as well), relro_prot is what it was made. */
+static void rebind_relocations (struct dl_phdr_info *info, const elf_symbol_table_t *table,
+                                ElfW(Addr) relro_start, ElfW(Addr) relro_end, int relro_prot,
+                                const char *relocs, size_t size, size_t entsize, rebind_request_t *request)
+{
+    uintptr_t page_size = rebind_page_size ();
+    size_t i;
+
+    if (!relocs || !entsize)
+        return;
+
+    /* ElfW(Rel) is a prefix of ElfW(Rela), so this works for both. */
+    for (i = 0; i + entsize <= size; i += entsize) {
+        const ElfW(Rel) *rel = (const ElfW(Rel) *) (relocs + i);
+        ElfW(Word) symix = ELF_R_SYM (rel->r_info);
+        void **slot;
+
+        if (symix == 0 || strcmp (table->strtab + table->symtab[symix].st_name, request->name) != 0)
+            continue;
+
+        slot = (void **) (info->dlpi_addr + rel->r_offset);
+        if (*slot != request->from)
+            continue;
+
+        if ((ElfW(Addr)) slot >= relro_start && (ElfW(Addr)) slot < relro_end) {
+            void *page = (void *) ((uintptr_t) slot & ~(page_size - 1));
+            if (mprotect (page, page_size, relro_prot | PROT_WRITE) < 0)
+                continue;
+            __atomic_store_n (slot, request->to, __ATOMIC_RELAXED);
+            (void) mprotect (page, page_size, relro_prot);
+        } else {
+            __atomic_store_n (slot, request->to, __ATOMIC_RELAXED);
+        }
+        request->rebound++;
+    }
+}
+
+static int rebind_symbol_callback (struct dl_phdr_info *info, size_t size, void *data)
+{
+    rebind_request_t *request = data;
+    elf_symbol_table_t table;
+    const ElfW(Dyn) *dyn = NULL;
+    const char *rel = NULL, *rela = NULL, *jmprel = NULL;
+    size_t relsz = 0, relent = 0, relasz = 0, relaent = 0, pltrelsz = 0;
+    ElfW(Sxword) pltrel = DT_NULL;
+    ElfW(Addr) relro_start = 0, relro_end = 0;
+    uintptr_t page_size = rebind_page_size ();
+    int relro_prot = PROT_READ;
+    ElfW(Half) n;
+
+    if (elf_symbol_table_init (&table, info) < 0)
+        return 0;
+
+    for (n = 0; n < info->dlpi_phnum; n++) {
+        if (info->dlpi_phdr[n].p_type == PT_DYNAMIC) {
+            dyn = (const ElfW(Dyn) *) (info->dlpi_addr + info->dlpi_phdr[n].p_vaddr);
+        } else if (info->dlpi_phdr[n].p_type == PT_GNU_RELRO) {
+            /* Same rounding as _dl_protect_relro() in ld.so */
+            relro_start = info->dlpi_addr + info->dlpi_phdr[n].p_vaddr;
+            relro_end = (relro_start + info->dlpi_phdr[n].p_memsz) & ~(ElfW(Addr)) (page_size - 1);
+            relro_start &= ~(ElfW(Addr)) (page_size - 1);
+            relro_prot = ((info->dlpi_phdr[n].p_flags & PF_R) ? PROT_READ : 0) |
+                         ((info->dlpi_phdr[n].p_flags & PF_X) ? PROT_EXEC : 0);
+        }
+    }
+
+    for (; dyn->d_tag != DT_NULL; dyn++) {
+        switch (dyn->d_tag) {
+        case DT_REL:      rel = (const char *) elf_dynamic_pointer (table.base, dyn->d_un.d_ptr); break;
+        case DT_RELSZ:    relsz = dyn->d_un.d_val; break;
+        case DT_RELENT:   relent = dyn->d_un.d_val; break;
+        case DT_RELA:     rela = (const char *) elf_dynamic_pointer (table.base, dyn->d_un.d_ptr); break;
+        case DT_RELASZ:   relasz = dyn->d_un.d_val; break;
+        case DT_RELAENT:  relaent = dyn->d_un.d_val; break;
+        case DT_JMPREL:   jmprel = (const char *) elf_dynamic_pointer (table.base, dyn->d_un.d_ptr); break;
+        case DT_PLTRELSZ: pltrelsz = dyn->d_un.d_val; break;
+        case DT_PLTREL:   pltrel = dyn->d_un.d_val; break;
+        }
+    }
+
+    rebind_relocations (info, &table, relro_start, relro_end, relro_prot, rel, relsz, relent, request);
+    rebind_relocations (info, &table, relro_start, relro_end, relro_prot, rela, relasz, relaent, request);
+    rebind_relocations (info, &table, relro_start, relro_end, relro_prot, jmprel, pltrelsz,
+                        pltrel == DT_RELA ? sizeof (ElfW(Rela)) : sizeof (ElfW(Rel)), request);
+    return 0;
+}
+
+static unsigned long rebind_symbol (const char *name, void *from, void *to)
+{
+    rebind_request_t request = { name, from, to, 0 };
+
+    if (!from || !to || from == to)
+        return 0;
+    dl_iterate_phdr (rebind_symbol_callback, &request);
+    return request.rebound;
+}
+
+/* Whether the user asked for interposers that are no longer needed to be
+ * unhooked with rebind_symbol(). */
+static int unhook_requested ()
+{
+    const char *env = getenv ("GTK3_NOCSD_UNHOOK");
+    return env && *env && strcmp (env, "0") != 0;
+}
+
+static void fill_runtime_import_table (const elf_symbol_table_t *table, int library_id, int v2)
+{
+    void *func;
+    int i;
+
+    for (i = 0; i < NUM_RUNTIME_IMPORTS; i++) {
+        if (runtime_imports[i].library != library_id || (v2 && !runtime_imports[i].try_gtk2))
+            continue;
+        if (runtime_import_table[v2 * NUM_RUNTIME_IMPORTS + i])
+            continue;
+        func = elf_symbol_table_lookup (table, runtime_imports[i].name);
+        if (func) {
+            __atomic_store_n (&runtime_import_table[v2 * NUM_RUNTIME_IMPORTS + i], func, __ATOMIC_RELAXED);
+            __sync_fetch_and_add (&stats.symbols_resolved, 1);
+        }
+    }
+    runtime_import_library_filled[v2 * NUM_LIBRARIES + library_id] = 1;
+}
+
+static int fill_runtime_import_tables_callback (struct dl_phdr_info *info, size_t size, void *data)
+{
+    elf_symbol_table_t table;
+    int library_id;
+
+    if (elf_symbol_table_init (&table, info) < 0 || !table.soname)
+        return 0;
+
+    for (library_id = 0; library_id < NUM_LIBRARIES; library_id++) {
+        if (!runtime_import_library_filled[library_id] && strcmp (table.soname, library_sonames[library_id]) == 0) {
+            __sync_fetch_and_add (&stats.libraries_scanned, 1);
+            fill_runtime_import_table (&table, library_id, 0);
+        } else if (library_sonames_v2[library_id] && !runtime_import_library_filled[NUM_LIBRARIES + library_id]
+                   && strcmp (table.soname, library_sonames_v2[library_id]) == 0) {
+            __sync_fetch_and_add (&stats.libraries_scanned, 1);
+            fill_runtime_import_table (&table, library_id, 1);
+        }
+    }
+    return 0;
+}
+
+static void *resolve_runtime_import (int try_gtk2, int id)
+{
+    int v2 = try_gtk2 && gtk2_active;
+    unsigned long long start = stats_timer_start ();
+    void *func;
+
+    pthread_mutex_lock (&runtime_import_mutex);
+    func = runtime_import_table[v2 * NUM_RUNTIME_IMPORTS + id];
+    if (!func && !runtime_import_library_filled[v2 * NUM_LIBRARIES + runtime_imports[id].library]) {
+        /* Fill the tables of all libraries that appeared since the last
+         * time, not just the one we currently need. */
+        dl_iterate_phdr (fill_runtime_import_tables_callback, NULL);
+        func = runtime_import_table[v2 * NUM_RUNTIME_IMPORTS + id];
+    }
+    if (!func) {
+        /* Library without a GNU hash table, an IFUNC or something like
+         * that: just do what the dynamic linker would do. */
+        func = find_orig_function (try_gtk2, runtime_imports[id].library, runtime_imports[id].name);
+        if (func) {
+            __atomic_store_n (&runtime_import_table[v2 * NUM_RUNTIME_IMPORTS + id], func, __ATOMIC_RELAXED);
+            __sync_fetch_and_add (&stats.symbols_dlsym_fallback, 1);
+        } else {
+            __sync_fetch_and_add (&stats.symbols_unresolved, 1);
+        }
+    }
+    pthread_mutex_unlock (&runtime_import_mutex);
+
+    stats_timer_stop (&stats.resolve_ns, start);
+    return func;
+}
+
+static inline void *runtime_import (int try_gtk2, int id)
+{
+    void *func;
+
+    if (try_gtk2 && G_UNLIKELY (gtk2_active))
+        func = __atomic_load_n (&runtime_import_table[NUM_RUNTIME_IMPORTS + id], __ATOMIC_RELAXED);
+    else
+        func = __atomic_load_n (&runtime_import_table[id], __ATOMIC_RELAXED);
+    if (G_UNLIKELY (!func))
+        func = resolve_runtime_import (try_gtk2, id);
+    return func;
+}
+
 /* If a binary is compiled with ELF flag NOW (corresponding to RTLD_NOW),
  * but is not linked against gtk, if we use symbols from gtk the binary
  * they will fail to load. But we can't link this library against gtk3,
  * because we don't want to pull that in to every program and that
  * would also be incompatible with gtk2. Therefore, make sure we import
- * every function, not just those that we override, at runtime. */
-#define HIDDEN_NAME2(a,b)   a ## b
-#define NAME2(a,b)          HIDDEN_NAME2(a,b)
+ * every function, not just those that we override, at runtime. (Not
+ * every build configuration uses every import, see GTK_TARGET.) */
 #define RUNTIME_IMPORT_FUNCTION(try_gtk2, library, function_name, return_type, arg_def_list, arg_use_list) \
-    static return_type NAME2(rtlookup_, function_name) arg_def_list { \
-        static return_type (*orig_func) arg_def_list = NULL;\
-        if (!orig_func) \
-            orig_func = find_orig_function(try_gtk2, library, #function_name); \
+    static G_GNUC_UNUSED return_type NAME2(rtlookup_, function_name) arg_def_list { \
+        return_type (*orig_func) arg_def_list = runtime_import (try_gtk2, NAME2(RTLOOKUP_, function_name)); \
         return orig_func arg_use_list; \
     }
 
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_css_provider_new, GtkCssProvider *, (), ())
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_css_provider_load_from_data, void, (GtkCssProvider *provider, const gchar *data, gssize length, GError **error), (provider, data, length, error))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_window_new, GtkWidget *, (GtkWindowType type), (type))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_header_bar_new, GtkWidget *, (), ())
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_window_get_type, GType, (), ())
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_header_bar_get_type, GType, (), ())
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_window_get_titlebar, GtkWidget *, (GtkWindow *window), (window))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_get_type, GType, (), ())
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_buildable_get_type, GType, (), ())
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_window_set_titlebar, void, (GtkWindow *window, GtkWidget *titlebar), (window, titlebar))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_header_bar_set_show_close_button, void, (GtkHeaderBar *bar, gboolean setting), (bar, setting))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_header_bar_set_decoration_layout, void, (GtkHeaderBar *bar, const gchar *layout), (bar, layout))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_header_bar_get_decoration_layout, const gchar *, (GtkHeaderBar *bar), (bar))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_style_context_add_class, void, (GtkStyleContext *context, const gchar *class_name), (context, class_name))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_style_context_remove_class, void, (GtkStyleContext *context, const gchar *class_name), (context, class_name))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_style_context_add_provider, void, (GtkStyleContext *context, GtkStyleProvider *provider, guint priority), (context, provider, priority))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_style_provider_get_type, GType, (), ())
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_destroy, void, (GtkWidget *widget), (widget))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_get_mapped, gboolean, (GtkWidget *widget), (widget))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_get_realized, gboolean, (GtkWidget *widget), (widget))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_get_style_context, GtkStyleContext *, (GtkWidget *widget), (widget))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_map, void, (GtkWidget *widget), (widget))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_set_parent, void, (GtkWidget *widget, GtkWidget *parent), (widget, parent))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_unrealize, void, (GtkWidget *widget), (widget))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_realize, void, (GtkWidget *widget), (widget))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_get_settings, GtkSettings *, (GtkWidget *widget), (widget))
-RUNTIME_IMPORT_FUNCTION(0, GTK_LIBRARY, gtk_widget_get_toplevel, GtkWidget *, (GtkWidget *widget), (widget))
-RUNTIME_IMPORT_FUNCTION(0, GDK_LIBRARY, gdk_window_get_user_data, void, (GdkWindow *window, gpointer *data), (window, data))
-RUNTIME_IMPORT_FUNCTION(1, GDK_LIBRARY, gdk_screen_is_composited, gboolean, (GdkScreen *screen), (screen))
-RUNTIME_IMPORT_FUNCTION(1, GDK_LIBRARY, gdk_window_set_decorations, void, (GdkWindow *window, GdkWMDecoration decorations), (window, decorations))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_object_get_data, gpointer, (GObject *object, const gchar *key), (object, key))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_object_set_data, void, (GObject *object, const gchar *key, gpointer data), (object, key, data))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_object_ref, gpointer, (gpointer object), (object))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_object_unref, void, (gpointer object), (object))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_type_check_class_cast, GTypeClass *, (GTypeClass *g_class, GType is_a_type), (g_class, is_a_type))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_type_check_instance_is_a, gboolean, (GTypeInstance *instance, GType iface_type), (instance, iface_type))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_type_check_instance_cast, GTypeInstance *, (GTypeInstance *instance, GType iface_type), (instance, iface_type))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_object_class_find_property, GParamSpec *, (GObjectClass *oclass, const gchar *property_name), (oclass, property_name))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_type_register_static_simple, GType, (GType parent_type, const gchar *type_name, guint class_size, GClassInitFunc class_init, guint instance_size, GInstanceInitFunc instance_init, GTypeFlags flags), (parent_type, type_name, class_size, class_init, instance_size, instance_init, flags))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_type_add_interface_static, void, (GType instance_type, GType interface_type, const GInterfaceInfo *info), (instance_type, interface_type, info))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_type_add_instance_private, gint, (GType class_type, gsize private_size), (class_type, private_size))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_type_instance_get_private, gpointer, (GTypeInstance *instance, GType private_type), (instance, private_type))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_type_value_table_peek, GTypeValueTable *, (GType type), (type))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_type_check_instance_is_fundamentally_a, gboolean, (GTypeInstance *instance, GType fundamental_type), (instance, fundamental_type))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_signal_connect_data, gulong, (gpointer instance, const gchar *detailed_signal, GCallback c_handler, gpointer data, GClosureNotify destroy_data, GConnectFlags connect_flags), (instance, detailed_signal, c_handler, data, destroy_data, connect_flags))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_signal_handlers_disconnect_matched, guint, (gpointer instance, GSignalMatchType mask, guint signal_id, GQuark detail, GClosure *closure, gpointer func, gpointer data), (instance, mask, signal_id, detail, closure, func, data))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_object_get_valist, void, (GObject *object, const gchar *first_property_name, va_list var_args), (object, first_property_name, var_args))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_object_get_property, void, (GObject *object, const gchar *property_name, GValue *value), (object, property_name, value))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_value_init, GValue *, (GValue *value, GType g_type), (value, g_type))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_value_unset, void, (GValue *value), (value))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_value_get_string, const gchar *, (const GValue *value), (value))
-RUNTIME_IMPORT_FUNCTION(0, GOBJECT_LIBRARY, g_value_get_boolean, gboolean, (const GValue *value), (value))
-RUNTIME_IMPORT_FUNCTION(0, GLIB_LIBRARY, g_getenv, gchar *, (const char *name), (name))
-RUNTIME_IMPORT_FUNCTION(0, GLIB_LIBRARY, g_logv, void, (const gchar *log_domain, GLogLevelFlags log_level, const gchar *format, va_list args), (log_domain, log_level, format, args))
-RUNTIME_IMPORT_FUNCTION(0, GLIB_LIBRARY, g_free, void, (gpointer mem), (mem))
-RUNTIME_IMPORT_FUNCTION(0, GLIB_LIBRARY, g_strdup, gchar *, (const gchar *str), (str))
-RUNTIME_IMPORT_FUNCTION(0, GLIB_LIBRARY, g_strfreev, void, (gchar **str_array), (str_array))
-RUNTIME_IMPORT_FUNCTION(0, GLIB_LIBRARY, g_strlcat, gsize, (gchar *dest, const gchar *src, gsize dest_size), (dest, src, dest_size))
-RUNTIME_IMPORT_FUNCTION(0, GLIB_LIBRARY, g_strlcpy, gsize, (gchar *dest, const gchar *src, gsize dest_size), (dest, src, dest_size))
-RUNTIME_IMPORT_FUNCTION(0, GLIB_LIBRARY, g_strsplit, gchar **, (const gchar *string, const gchar *delimiter, gint max_tokens), (string, delimiter, max_tokens))
-RUNTIME_IMPORT_FUNCTION(0, GLIB_LIBRARY, g_assertion_message_expr, void, (const char *domain, const char *file, int line, const char *func, const char *expr), (domain, file, line, func, expr))
-RUNTIME_IMPORT_FUNCTION(0, GIREPOSITORY_LIBRARY, g_function_info_prep_invoker, gboolean, (GIFunctionInfo *info, GIFunctionInvoker *invoker, GError **error), (info, invoker, error))
+RUNTIME_IMPORTS(RUNTIME_IMPORT_FUNCTION)
+
+/* The statistics may be written from a signal handler, so only use
+ * async-signal-safe functions here (no stdio, no malloc). */
+typedef struct stats_buffer_t {
+    char data[8192];
+    size_t len;
+} stats_buffer_t;
+
+static void stats_append (stats_buffer_t *buf, const char *str)
+{
+    while (*str && buf->len < sizeof (buf->data))
+        buf->data[buf->len++] = *str++;
+}
+
+static void stats_append_number (stats_buffer_t *buf, unsigned long long value)
+{
+    char digits[24];
+    int n = sizeof (digits) - 1;
+
+    digits[n] = '\0';
+    do {
+        digits[--n] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    stats_append (buf, &digits[n]);
+}
+
+static void stats_append_field (stats_buffer_t *buf, const char *prefix, const char *name, unsigned long long value)
+{
+    stats_append (buf, prefix);
+    stats_append (buf, "\"");
+    stats_append (buf, name);
+    stats_append (buf, "\": ");
+    stats_append_number (buf, value);
+}
+
+static void write_stats ()
+{
+    stats_buffer_t buf;
+    const gtk3_nocsd_hook_stats_t *block;
+    unsigned long long calls, ticks;
+    int fd, i, r;
+    size_t written;
+
+    buf.len = 0;
+    stats_append_field (&buf, "{", "pid", (unsigned long long) getpid ());
+    stats_append_field (&buf, ", \"symbols\": {", "resolved", stats.symbols_resolved);
+    stats_append_field (&buf, ", ", "dlsym_fallback", stats.symbols_dlsym_fallback);
+    stats_append_field (&buf, ", ", "unresolved", stats.symbols_unresolved);
+    stats_append_field (&buf, ", ", "libraries_scanned", stats.libraries_scanned);
+    stats_append_field (&buf, ", ", "resolve_ns", stats.resolve_ns);
+    stats_append_field (&buf, "}, \"phases\": {", "symbol_resolution_ns", stats.resolve_ns);
+    stats_append_field (&buf, ", ", "probe_ns", stats.probe_ns);
+    stats_append_field (&buf, ", ", "css_ns", stats.css_ns);
+    stats_append_field (&buf, ", ", "titlebar_ns", stats.titlebar_ns);
+    stats_append_field (&buf, ", ", "titlebar_calls", stats.titlebar_calls);
+    stats_append (&buf, "}, \"hooks\": {\"ticks_unit\": \"" HOOK_TICKS_UNIT "\"");
+    stats_append_field (&buf, ", ", "threads", hook_stats_blocks);
+    for (i = 0; i < NUM_HOOKS; i++) {
+        calls = ticks = 0;
+        for (block = __atomic_load_n (&hook_stats_list, __ATOMIC_ACQUIRE); block; block = block->next) {
+            calls += block->calls[i];
+            ticks += block->ticks[i];
+        }
+        stats_append (&buf, ", \"");
+        stats_append (&buf, hook_names[i]);
+        stats_append_field (&buf, "\": {", "calls", calls);
+        stats_append_field (&buf, ", ", "ticks", ticks);
+        stats_append (&buf, "}");
+    }
+    stats_append (&buf, "}}\n");
+    if (buf.len == sizeof (buf.data))
+        buf.data[buf.len - 1] = '\n';
+
+    fd = stats_file ? open (stats_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644) : STDERR_FILENO;
+    if (fd < 0)
+        return;
+    for (written = 0; written < buf.len; written += r) {
+        r = write (fd, buf.data + written, buf.len - written);
+        if (r < 0 && errno == EINTR) {
+            r = 0;
+            continue;
+        }
+        if (r <= 0)
+            break;
+    }
+    if (fd != STDERR_FILENO)
+        close (fd);
+}
+
+static void stats_signal_handler (int signum)
+{
+    int saved_errno = errno;
+    write_stats ();
+    errno = saved_errno;
+}
+
+static void install_stats_signal_handler (const char *name)
+{
+    struct sigaction action;
+    int signum;
+
+    if (strncmp (name, "SIG", 3) == 0)
+        name += 3;
+    if (strcmp (name, "USR1") == 0)
+        signum = SIGUSR1;
+    else if (strcmp (name, "USR2") == 0)
+        signum = SIGUSR2;
+    else if (strcmp (name, "HUP") == 0)
+        signum = SIGHUP;
+    else
+        signum = atoi (name);
+    if (signum <= 0 || signum >= NSIG)
+        return;
+
+    memset (&action, 0, sizeof (action));
+    action.sa_handler = stats_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset (&action.sa_mask);
+    (void) sigaction (signum, &action, NULL);
+}
+
+/* Per-application policy, read once at startup from
+ * $XDG_CONFIG_HOME/gtk3-nocsd/apps.conf (~/.config/gtk3-nocsd/apps.conf
+ * by default). Every line is "allow PATTERN", "deny PATTERN" or
+ * "default allow|deny"; empty lines and lines starting with '#' are
+ * ignored. A PATTERN is a shell wildcard pattern, matched against the
+ * full path of the executable if it contains a '/' and against the
+ * program name (the base name of argv[0], which is also what GLib
+ * uses as the default prgname) otherwise. The first matching rule
+ * decides, otherwise the default applies (allow, unless set).
+ *
+ * In a denied process, every interposed function just calls the
+ * original one, without looking at anything else, so the library can
+ * be preloaded globally without slowing down the programs it doesn't
+ * apply to.
+ *
+ * The same goes for the GObject functions in processes that haven't
+ * loaded Gtk (yet): GLib programs such as daemons and command line
+ * tools call them a lot, but there's nothing for us to do before the
+ * first Gtk type is registered. We don't need to watch dlopen() for
+ * Gtk showing up later, that first registration (which always goes
+ * through g_type_register_static_simple, the watched types do as
+ * well) is where the passthrough ends. */
+enum {
+    PASSTHROUGH_EXCLUDED    = 1 << 0,
+    PASSTHROUGH_NO_GTK      = 1 << 1
+};
+
+static volatile int passthrough = PASSTHROUGH_NO_GTK;
+
+static void leave_no_gtk_passthrough ()
+{
+    __sync_fetch_and_and (&passthrough, ~PASSTHROUGH_NO_GTK);
+}
+
+static int app_policy_path (char *path, size_t path_size)
+{
+    const char *config_home = getenv ("XDG_CONFIG_HOME");
+    int r;
+
+    if (config_home && config_home[0] == '/') {
+        r = snprintf (path, path_size, "%s/gtk3-nocsd/apps.conf", config_home);
+    } else {
+        const char *home = getenv ("HOME");
+        if (!home || home[0] != '/')
+            return -1;
+        r = snprintf (path, path_size, "%s/.config/gtk3-nocsd/apps.conf", home);
+    }
+    if (r < 0 || (size_t) r >= path_size)
+        return -1;
+    return 0;
+}
+
+static int app_policy_excludes_process ()
+{
+    char path[PATH_MAX];
+    char exe[PATH_MAX];
+    char line[PATH_MAX + 16];
+    char *keyword, *pattern, *end;
+    int default_excluded = 0;
+    int excluded = -1;
+    int allow;
+    ssize_t n;
+    FILE *f;
+
+    if (app_policy_path (path, sizeof (path)) < 0 || !(f = fopen (path, "re")))
+        return 0;
+
+    n = readlink ("/proc/self/exe", exe, sizeof (exe) - 1);
+    exe[n > 0 ? n : 0] = '\0';
+
+    while (excluded < 0 && fgets (line, sizeof (line), f)) {
+        keyword = line + strspn (line, " \t");
+        end = keyword + strcspn (keyword, " \t\r\n");
+        pattern = end + strspn (end, " \t");
+        *end = '\0';
+        for (end = pattern + strlen (pattern); end > pattern && strchr (" \t\r\n", end[-1]); end--)
+            ;
+        *end = '\0';
+
+        if (strcmp (keyword, "allow") == 0)
+            allow = 1;
+        else if (strcmp (keyword, "deny") == 0)
+            allow = 0;
+        else {
+            if (strcmp (keyword, "default") == 0)
+                default_excluded = strcmp (pattern, "deny") == 0;
+            continue;
+        }
+
+        if (!*pattern)
+            continue;
+        if (strchr (pattern, '/') ? (exe[0] && fnmatch (pattern, exe, FNM_PATHNAME) == 0)
+                                  : fnmatch (pattern, program_invocation_short_name, 0) == 0)
+            excluded = !allow;
+    }
+    fclose (f);
+
+    return excluded < 0 ? default_excluded : excluded;
+}
+
+__attribute__((constructor)) static void init_runtime_imports (void)
+{
+    const char *env;
+    unsigned long long start;
+
+    /* For excluded processes, functions are resolved when they are
+     * first forwarded to, and there are no statistics. */
+    if (app_policy_excludes_process ()) {
+        __sync_fetch_and_or (&passthrough, PASSTHROUGH_EXCLUDED);
+        return;
+    }
+
+    env = getenv ("GTK3_NOCSD_STATS");
+    stats_enabled = env && *env;
+    start = stats_timer_start ();
+    if (stats_enabled) {
+        env = getenv ("GTK3_NOCSD_STATS_FILE");
+        if (env && *env)
+            stats_file = strdup (env);
+        env = getenv ("GTK3_NOCSD_STATS_SIGNAL");
+        if (env && *env)
+            install_stats_signal_handler (env);
+    }
+
+    /* Most of the time GLib and GObject (and Gtk, if the program is
+     * linked against it) are already there, so resolve them in one go
+     * right now. */
+    pthread_mutex_lock (&runtime_import_mutex);
+    dl_iterate_phdr (fill_runtime_import_tables_callback, NULL);
+    pthread_mutex_unlock (&runtime_import_mutex);
+
+    if (runtime_import_library_filled[GTK_LIBRARY] || runtime_import_library_filled[NUM_LIBRARIES + GDK_LIBRARY])
+        leave_no_gtk_passthrough ();
+
+    stats_timer_stop (&stats.resolve_ns, start);
+}
+
+__attribute__((destructor)) static void dump_stats (void)
+{
+    if (stats_enabled)
+        write_stats ();
+}
 
 /* All methods that we want to overwrite are named orig_, all methods
  * that we just want to call (either directly or indirectrly)
@@ -329,12 +1199,13 @@ RUNTIME_IMPORT_FUNCTION(0, GIREPOSITORY_LIBRARY, g_function_info_prep_invoker, g
 #define orig_gtk_header_bar_get_decoration_layout        rtlookup_gtk_header_bar_get_decoration_layout
 #define gtk_style_context_add_class                      rtlookup_gtk_style_context_add_class
 #define gtk_style_context_remove_class                   rtlookup_gtk_style_context_remove_class
-#define gtk_style_context_add_provider                   rtlookup_gtk_style_context_add_provider
+#define gtk_style_context_add_provider_for_screen        rtlookup_gtk_style_context_add_provider_for_screen
 #define gtk_style_provider_get_type                      rtlookup_gtk_style_provider_get_type
 #define gtk_widget_destroy                               rtlookup_gtk_widget_destroy
 #define gtk_widget_get_mapped                            rtlookup_gtk_widget_get_mapped
 #define gtk_widget_get_realized                          rtlookup_gtk_widget_get_realized
 #define gtk_widget_get_style_context                     rtlookup_gtk_widget_get_style_context
+#define gtk_widget_get_screen                            rtlookup_gtk_widget_get_screen
 #define gtk_widget_map                                   rtlookup_gtk_widget_map
 #define gtk_widget_set_parent                            rtlookup_gtk_widget_set_parent
 #define gtk_widget_unrealize                             rtlookup_gtk_widget_unrealize
@@ -342,19 +1213,18 @@ RUNTIME_IMPORT_FUNCTION(0, GIREPOSITORY_LIBRARY, g_function_info_prep_invoker, g
 #define gdk_window_get_user_data                         rtlookup_gdk_window_get_user_data
 #define orig_gdk_screen_is_composited                    rtlookup_gdk_screen_is_composited
 #define orig_gdk_window_set_decorations                  rtlookup_gdk_window_set_decorations
-#define g_object_get_data                                rtlookup_g_object_get_data
-#define g_object_set_data                                rtlookup_g_object_set_data
+#define g_object_get_qdata                               rtlookup_g_object_get_qdata
+#define g_object_set_qdata                               rtlookup_g_object_set_qdata
+#define g_object_set_qdata_full                          rtlookup_g_object_set_qdata_full
+#define g_quark_from_static_string                       rtlookup_g_quark_from_static_string
 #define g_type_check_class_cast                          rtlookup_g_type_check_class_cast
+#define g_type_class_peek_parent                         rtlookup_g_type_class_peek_parent
 #define g_type_check_instance_is_a                       rtlookup_g_type_check_instance_is_a
 #define g_type_check_instance_cast                       rtlookup_g_type_check_instance_cast
 #define g_object_class_find_property                     rtlookup_g_object_class_find_property
 #define g_object_get_valist                              rtlookup_g_object_get_valist
-#define g_object_get_property                            rtlookup_g_object_get_property
 #define g_object_ref                                     rtlookup_g_object_ref
 #define g_object_unref                                   rtlookup_g_object_unref
-#define g_value_init                                     rtlookup_g_value_init
-#define g_value_unset                                    rtlookup_g_value_unset
-#define g_value_get_string                               rtlookup_g_value_get_string
 #define g_value_get_boolean                              rtlookup_g_value_get_boolean
 #define orig_g_type_register_static_simple               rtlookup_g_type_register_static_simple
 #define orig_g_type_add_interface_static                 rtlookup_g_type_add_interface_static
@@ -367,12 +1237,10 @@ RUNTIME_IMPORT_FUNCTION(0, GIREPOSITORY_LIBRARY, g_function_info_prep_invoker, g
 #define g_getenv                                         rtlookup_g_getenv
 #define g_logv                                           rtlookup_g_logv
 #define g_log                                            static_g_log
+#define g_malloc0                                        rtlookup_g_malloc0
 #define g_free                                           rtlookup_g_free
 #define g_strdup                                         rtlookup_g_strdup
-#define g_strfreev                                       rtlookup_g_strfreev
-#define g_strlcat                                        rtlookup_g_strlcat
-#define g_strlcpy                                        rtlookup_g_strlcpy
-#define g_strsplit                                       rtlookup_g_strsplit
+#define g_idle_add_full                                  rtlookup_g_idle_add_full
 #define gtk_widget_get_settings                          rtlookup_gtk_widget_get_settings
 #define gtk_widget_get_toplevel                          rtlookup_gtk_widget_get_toplevel
 #define g_assertion_message_expr                         rtlookup_g_assertion_message_expr
@@ -387,6 +1255,14 @@ static void static_g_log(const gchar *log_domain, GLogLevelFlags log_level, cons
     va_end (args);
 }
 
+static void set_gtk2_active()
+{
+    gtk2_active = 1;
+    /* The gtk version could have already been checked before we were
+     * able to determine that gtk2 is in use, so force a new check. */
+    gtk_capabilities_cached = 0;
+}
+
 int check_gtk2_callback(struct dl_phdr_info *info, size_t size, void *pointer)
 {
     ElfW(Half) n;
@@ -396,12 +1272,7 @@ int check_gtk2_callback(struct dl_phdr_info *info, size_t size, void *pointer)
             uintptr_t start = (uintptr_t) (info->dlpi_addr + info->dlpi_phdr[n].p_vaddr);
             uintptr_t end   = start + (uintptr_t) info->dlpi_phdr[n].p_memsz;
             if ((uintptr_t) pointer >= start && (uintptr_t) pointer < end) {
-                gtk2_active = 1;
-                /* The gtk version check could have already been cached
-                 * before we were able to determine that gtk2 is in
-                 * use, so force this to FALSE. (Regardless of  the
-                 * _checked value.) */
-                is_compatible_gtk_version_cached = FALSE;
+                set_gtk2_active();
                 return 0;
             }
         }
@@ -409,6 +1280,95 @@ int check_gtk2_callback(struct dl_phdr_info *info, size_t size, void *pointer)
     return 0;
 }
 
+/* Address ranges of all loaded gdk2 libraries, so that detect_gtk2()
+ * doesn't need to look at the name of every loaded object each time.
+ * The index is brought up to date by looking at the objects that were
+ * loaded since the last time (or rebuilt if any were unloaded), as
+ * indicated by the dlpi_adds / dlpi_subs counters of the dynamic
+ * linker. */
+typedef struct gtk2_range_t {
+    uintptr_t start;
+    uintptr_t end;
+} gtk2_range_t;
+
+#define MAX_GTK2_RANGES 16
+
+static pthread_mutex_t gtk2_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static gtk2_range_t gtk2_index_ranges[MAX_GTK2_RANGES];
+static int gtk2_index_count = 0;
+static int gtk2_index_valid = 0;
+static size_t gtk2_index_objects = 0;
+static unsigned long long gtk2_index_adds = 0;
+static unsigned long long gtk2_index_subs = 0;
+
+typedef struct gtk2_index_walk_t {
+    size_t position;
+    int overflow;
+} gtk2_index_walk_t;
+
+static int gtk2_index_callback(struct dl_phdr_info *info, size_t size, void *data)
+{
+    gtk2_index_walk_t *walk = data;
+    ElfW(Half) n;
+
+    /* Objects up to here have already been looked at. */
+    if (walk->position++ < gtk2_index_objects)
+        return 0;
+    if (G_LIKELY(!strstr(info->dlpi_name, GDK_LIBRARY_SONAME_V2)))
+        return 0;
+    for (n = 0; n < info->dlpi_phnum; n++) {
+        if (info->dlpi_phdr[n].p_type != PT_LOAD)
+            continue;
+        if (gtk2_index_count == MAX_GTK2_RANGES) {
+            walk->overflow = 1;
+            return 1;
+        }
+        gtk2_index_ranges[gtk2_index_count].start = (uintptr_t) (info->dlpi_addr + info->dlpi_phdr[n].p_vaddr);
+        gtk2_index_ranges[gtk2_index_count].end = gtk2_index_ranges[gtk2_index_count].start + (uintptr_t) info->dlpi_phdr[n].p_memsz;
+        gtk2_index_count++;
+    }
+    return 0;
+}
+
+/* Returns 1 if the pointer is within gdk2, 0 if not, -1 if the index
+ * can't be used. */
+static int gtk2_index_lookup(uintptr_t pointer)
+{
+    unsigned long long generation[2];
+    gtk2_index_walk_t walk = { 0, 0 };
+    int i, result = -1;
+
+    pthread_mutex_lock(&gtk2_index_mutex);
+    if (dl_iterate_phdr(link_map_generation_callback, generation) != 1)
+        goto out;
+
+    if (!gtk2_index_valid || generation[1] != gtk2_index_subs) {
+        gtk2_index_objects = 0;
+        gtk2_index_count = 0;
+    }
+    if (!gtk2_index_valid || generation[0] != gtk2_index_adds || generation[1] != gtk2_index_subs) {
+        dl_iterate_phdr(gtk2_index_callback, &walk);
+        gtk2_index_objects = walk.position;
+        gtk2_index_adds = generation[0];
+        gtk2_index_subs = generation[1];
+        gtk2_index_valid = !walk.overflow;
+        if (walk.overflow)
+            goto out;
+    }
+
+    result = 0;
+    for (i = 0; i < gtk2_index_count; i++) {
+        if (pointer >= gtk2_index_ranges[i].start && pointer < gtk2_index_ranges[i].end) {
+            result = 1;
+            break;
+        }
+    }
+
+out:
+    pthread_mutex_unlock(&gtk2_index_mutex);
+    return result;
+}
+
 static void detect_gtk2(void *pointer)
 {
     if (gtk2_active)
@@ -417,39 +1377,74 @@ static void detect_gtk2(void *pointer)
      * multiple plugins, some of which are linked against gtk2, while
      * others are linked against gtk3. If the gtk2 plugins are used,
      * this causes problems if we detect gtk3 just on the fact of
-     * whether gtk3 is loaded. Hence we iterate over all loaded
-     * libraries and if the pointer passed to us is within the memory
-     * region of gtk2, we set a global flag. */
-    dl_iterate_phdr(check_gtk2_callback, pointer);
+     * whether gtk3 is loaded. Hence we look at the memory regions of
+     * all loaded gtk2 libraries, and if the pointer passed to us is
+     * within one of them, we set a global flag. */
+    unsigned long long start = hook_timer_start ();
+    int found = gtk2_index_lookup((uintptr_t) pointer);
+    if (found > 0)
+        set_gtk2_active();
+    else if (found < 0)
+        dl_iterate_phdr(check_gtk2_callback, pointer);
+    hook_timer_stop (HOOK_detect_gtk2_walk, start);
 }
 
-static gboolean is_gtk_version_larger_or_equal2(guint major, guint minor, guint micro, int* gtk_loaded) {
-    static gtk_check_version_t orig_func = NULL;
-    if(!orig_func)
-        orig_func = (gtk_check_version_t)find_orig_function(0, GTK_LIBRARY, "gtk_check_version");
+static int compute_gtk_capabilities() {
+    const guint *major = find_orig_function(0, GTK_LIBRARY, "gtk_major_version");
+    const guint *minor = find_orig_function(0, GTK_LIBRARY, "gtk_minor_version");
+    const guint *micro = find_orig_function(0, GTK_LIBRARY, "gtk_micro_version");
+    int version, caps;
 
-    /* We may have not been able to load the function IF a
-     * gtk2-using plugin was loaded into a non-gtk application. In
-     * that case, we don't want to do anything anyway, so just say
-     * we aren't compatible.
+    /* We may have not been able to find the version IF a gtk2-using
+     * plugin was loaded into a non-gtk application, or if Gtk has not
+     * been loaded yet (python-gi loads Glib before Gtk). Don't cache
+     * anything in that case, so we check again the next time.
      *
      * Note that if the application itself is using gtk2, RTLD_NEXT
-     * will give us a reference to gtk_check_version. But since
-     * that symbol is compatible with gtk3, this doesn't hurt.
+     * will give us gtk2's version, which is just as good.
      */
-     if (orig_func) {
-         if (gtk_loaded)
-             *gtk_loaded = TRUE;
-        return (orig_func(major, minor, micro) == NULL);
-     } else {
-         if (gtk_loaded)
-             *gtk_loaded = FALSE;
-        return FALSE;
-     }
+    if (!major || !minor || !micro)
+        return 0;
+
+    version = GTK3_NOCSD_VERSION_NUMBER (*major, *minor, *micro);
+    caps = GTK_CAP_KNOWN;
+    if (version >= GTK3_NOCSD_VERSION_NUMBER (3, 12, 0))
+        caps |= GTK_CAP_3_12_0;
+    if (version >= GTK3_NOCSD_VERSION_NUMBER (3, 16, 1))
+        caps |= GTK_CAP_3_16_1;
+
+    if (gtk2_active)
+        return caps;
+#ifdef GTK3_NOCSD_TARGET_MAJOR
+    if (version < GTK3_NOCSD_VERSION_NUMBER (GTK3_NOCSD_TARGET_MAJOR, GTK3_NOCSD_TARGET_MINOR, GTK3_NOCSD_TARGET_MICRO)) {
+        /* Built for a newer version than we have here. */
+        if (*major == 3)
+            g_warning ("libgtk3-nocsd: built for Gtk+ %d.%d.%d or newer, not disabling CSD",
+                       GTK3_NOCSD_TARGET_MAJOR, GTK3_NOCSD_TARGET_MINOR, GTK3_NOCSD_TARGET_MICRO);
+        return caps;
+    }
+#else
+    /* CSD was introduced there */
+    if (version < GTK3_NOCSD_VERSION_NUMBER (3, 10, 0))
+        return caps;
+#endif
+    return caps | GTK_CAP_COMPATIBLE;
 }
 
-static gboolean is_gtk_version_larger_or_equal(guint major, guint minor, guint micro) {
-    return is_gtk_version_larger_or_equal2(major, minor, micro, NULL);
+static inline int gtk_capabilities() {
+    int caps = gtk_capabilities_cached;
+    int was_gtk2_active;
+
+    if (G_UNLIKELY(!caps)) {
+        was_gtk2_active = gtk2_active;
+        caps = compute_gtk_capabilities();
+        gtk_capabilities_cached = caps;
+        /* detect_gtk2() in another thread could have reset the cache
+         * while we were computing it. */
+        if (G_UNLIKELY(gtk2_active != was_gtk2_active))
+            gtk_capabilities_cached = 0;
+    }
+    return caps;
 }
 
 static gboolean are_csd_disabled() {
@@ -463,35 +1458,29 @@ static gboolean are_csd_disabled() {
 }
 
 static gboolean is_compatible_gtk_version() {
-    int gtk_loaded = FALSE;
-
-    if(G_UNLIKELY(!is_compatible_gtk_version_checked)) {
-        if (gtk2_active) {
-            is_compatible_gtk_version_cached = FALSE;
-	} else if (!is_gtk_version_larger_or_equal2(3, 10, 0, &gtk_loaded)) {
-            /* CSD was introduced there */
-            is_compatible_gtk_version_cached = FALSE;
-        } else {
-            is_compatible_gtk_version_cached = TRUE;
-        }
-        /* If in a dynamical program (e.g. using python-gi) Glib is loaded before
-         * Gtk, then the Gtk version check is executed before Gtk is even loaded,
-         * returning FALSE and caching it. This will not disable CSD if Gtk is
-         * loaded later. To circumvent this, cache the value only if we know that
-         * Gtk is loaded. */
-        if (gtk_loaded)
-            is_compatible_gtk_version_checked = TRUE;
-    }
+    return (gtk_capabilities() & GTK_CAP_COMPATIBLE) != 0;
+}
 
-    return is_compatible_gtk_version_cached;
+/* Keys for the data we attach to objects. g_object_{get,set}_data would
+ * look the key up in GLib's global quark table (under a global lock)
+ * every time, so we do that only once. */
+static volatile GQuark custom_title_quark = 0;
+static volatile GQuark rewritten_layout_quark = 0;
+static volatile GQuark custom_css_quark = 0;
+
+static GQuark get_quark(volatile GQuark *quark, const char *name) {
+    GQuark q = *quark;
+    if (G_UNLIKELY(!q))
+        *quark = q = g_quark_from_static_string(name);
+    return q;
 }
 
 static void set_has_custom_title(GtkWindow* window, gboolean set) {
-    g_object_set_data(G_OBJECT(window), "custom_title", set ? GINT_TO_POINTER(1) : NULL);
+    g_object_set_qdata(G_OBJECT(window), get_quark(&custom_title_quark, "custom_title"), set ? GINT_TO_POINTER(1) : NULL);
 }
 
 static gboolean has_custom_title(GtkWindow* window) {
-    return (gboolean)GPOINTER_TO_INT(g_object_get_data(G_OBJECT(window), "custom_title"));
+    return (gboolean)GPOINTER_TO_INT(g_object_get_qdata(G_OBJECT(window), get_quark(&custom_title_quark, "custom_title")));
 }
 
 typedef void (*on_titlebar_title_notify_t) (GtkHeaderBar *titlebar, GParamSpec *pspec, GtkWindow *self);
@@ -514,6 +1503,9 @@ static GType gtk_header_bar_type = -1;
 
 static gtk_window_private_info_t gtk_window_private_info ();
 static gtk_header_bar_private_info_t gtk_header_bar_private_info ();
+static gboolean speculative_probe (gpointer data);
+
+#define GTK3_NOCSD_STYLE_CLASS "gtk3-nocsd"
 
 static GtkStyleProvider *get_custom_css_provider ()
 {
@@ -530,6 +1522,9 @@ static GtkStyleProvider *get_custom_css_provider ()
      * make sure that there are no small black pixels on the top left
      * and top right side of the window contents. This should also be
      * theme-agnostic.
+     * The provider is installed for the whole screen, so the rules
+     * only apply to title bars that we marked with our own style class
+     * (GTK3_NOCSD_STYLE_CLASS).
      * IMPORTANT: The CSS selectors here have to have the same (or
      * higher) selectivity than the selectors used in the theme's CSS.
      * Otherwise the settings here will not take effect, even though
@@ -537,13 +1532,13 @@ static GtkStyleProvider *get_custom_css_provider ()
      * <https://www.w3.org/TR/selectors/#specificity> for details.
      */
     static const char *custom_css =
-      "window > .titlebar:not(headerbar) {\n"
+      "window > .titlebar.gtk3-nocsd:not(headerbar) {\n"
       "  padding: 0;\n"
       "  border-style: none;\n"
       "  border-color: transparent;\n"
       "}\n"
-      ".background:not(.tiled):not(.maximized) .titlebar:backdrop,\n"
-      ".background:not(.tiled):not(.maximized) .titlebar {\n"
+      ".background:not(.tiled):not(.maximized) .titlebar.gtk3-nocsd:backdrop,\n"
+      ".background:not(.tiled):not(.maximized) .titlebar.gtk3-nocsd {\n"
       "  border-top-left-radius: 0;\n"
       "  border-top-right-radius: 0;\n"
       "}\n"
@@ -571,25 +1566,34 @@ static GtkStyleProvider *get_custom_css_provider ()
 
 static void add_custom_css (GtkWidget *widget)
 {
+    unsigned long long start = stats_timer_start ();
     GtkStyleContext *context = gtk_widget_get_style_context (widget);
+    GdkScreen *screen = gtk_widget_get_screen (widget);
     GtkStyleProvider *my_provider = get_custom_css_provider ();
 
-    if (!context || !my_provider)
-        return;
+    if (context && screen && my_provider) {
+        /* Adding a provider to a single style context makes Gtk rebuild
+         * the style of the widget and everything below it, so install
+         * it once for every screen, and just mark the widget.
+         * Use a higher priority than SETTINGS, but lower than APPLICATION.
+         */
+        if (!g_object_get_qdata (G_OBJECT (screen), get_quark (&custom_css_quark, "gtk3_nocsd_custom_css"))) {
+            g_object_set_qdata (G_OBJECT (screen), get_quark (&custom_css_quark, "gtk3_nocsd_custom_css"), GINT_TO_POINTER (1));
+            gtk_style_context_add_provider_for_screen (screen, my_provider, GTK_STYLE_PROVIDER_PRIORITY_SETTINGS + 50);
+        }
+        gtk_style_context_add_class (context, GTK3_NOCSD_STYLE_CLASS);
+    }
 
-    /* Use a higher priority than SETTINGS, but lower than APPLICATION.
-     * add_provider will make sure a given provider is not added twice.
-     */
-    gtk_style_context_add_provider (context, my_provider, GTK_STYLE_PROVIDER_PRIORITY_SETTINGS + 50);
+    stats_timer_stop (&stats.css_ns, start);
 }
 
 // This API exists since gtk+ 3.10
-extern void gtk_window_set_titlebar (GtkWindow *window, GtkWidget *titlebar) {
+static void _gtk_window_set_titlebar (GtkWindow *window, GtkWidget *titlebar) {
     if(!is_compatible_gtk_version() || !are_csd_disabled()) {
         orig_gtk_window_set_titlebar(window, titlebar);
         return;
     }
-    if (titlebar && is_gtk_version_larger_or_equal (3, 16, 1)) {
+    if (titlebar && GTK_AT_LEAST (3, 16, 1)) {
         /* We have to reimplement gtk_window_set_titlebar ourselves, since
          * those Gtk versions don't support turning CSD off anymore.
          * This mainly does the same things as the original function
@@ -597,6 +1601,7 @@ extern void gtk_window_set_titlebar (GtkWindow *window, GtkWidget *titlebar) {
          * but it will not enable CSD and not set the client_decorated flag
          * in the window private space. (We wouldn't know which bit it is
          * anyway.) */
+        unsigned long long start = stats_timer_start ();
         gtk_window_private_info_t private_info = gtk_window_private_info ();
         char *priv = G_TYPE_INSTANCE_GET_PRIVATE (window, gtk_window_type, char);
         gboolean was_mapped = FALSE;
@@ -651,67 +1656,106 @@ extern void gtk_window_set_titlebar (GtkWindow *window, GtkWidget *titlebar) {
         if (was_mapped)
             gtk_widget_map (widget);
 
+        stats_timer_stop (&stats.titlebar_ns, start);
+        if (G_UNLIKELY (stats_enabled))
+            __sync_fetch_and_add (&stats.titlebar_calls, 1);
         return;
     }
 
 orig_impl:
+#if NEED_COMPOSITE_HACK
     ++(TLSD->disable_composite);
+#endif
     orig_gtk_window_set_titlebar(window, titlebar);
     if(window && titlebar)
         set_has_custom_title(window, TRUE);
+#if NEED_COMPOSITE_HACK
     --(TLSD->disable_composite);
+#endif
+}
+
+extern void gtk_window_set_titlebar (GtkWindow *window, GtkWidget *titlebar) {
+    unsigned long long start;
+    if (passthrough & PASSTHROUGH_EXCLUDED) {
+        orig_gtk_window_set_titlebar (window, titlebar);
+        return;
+    }
+    start = hook_timer_start ();
+    _gtk_window_set_titlebar (window, titlebar);
+    hook_timer_stop (HOOK_gtk_window_set_titlebar, start);
 }
 
 static int _remove_buttons_from_layout (char *new_layout, const char *old_layout)
 {
-    gchar **tokens;
-    gchar **t;
-    int i, j, k;
+    static volatile int warned = 0;
 
-    /* Assumptions: new_layout fits 256 bytes (including NUL), so make sure
-     * that the old layout will fit */
-    if (strlen (old_layout) > 255)
+    if (!old_layout)
         return -1;
+    if (G_UNLIKELY (remove_buttons_from_layout (new_layout, old_layout) < 0)) {
+        if (!__sync_fetch_and_or (&warned, 1))
+            g_warning ("libgtk3-nocsd: decoration layout too long (more than %d bytes), not removing any buttons from it: %s",
+                       DECORATION_LAYOUT_SIZE - 1, old_layout);
+        return -1;
+    }
+    return 0;
+}
 
-    new_layout[0] = '\0';
-
-    tokens = g_strsplit (old_layout, ":", 2);
-    if (tokens) {
-        for (i = 0; i < 2; i++) {
-            if (tokens[i] == NULL)
-                break;
-            if (i)
-                g_strlcat (new_layout, ":", 256);
-            t = g_strsplit (tokens[i], ",", -1);
-            for (j = 0, k = 0; t[j]; j++) {
-                /* We want to remove all standard window icons, while retaining
-                 * custom stuff. */
-                if (!strcmp (t[j], "icon") || !strcmp (t[j], "minimize") || !strcmp (t[j], "maximize") || !strcmp (t[j], "close"))
-                    continue;
-                if (k)
-                    g_strlcat (new_layout, ",", 256);
-                g_strlcat (new_layout, t[j], 256);
-                k++;
-            }
+/* The same one or two layouts are rewritten over and over again (on
+ * every window state change, for example), so the result is attached
+ * to the object the original layout belongs to: the GtkSettings for
+ * the global gtk-decoration-layout setting, or the header bar for its
+ * own decoration-layout. Its notify signal marks the result as stale.
+ * GtkSettings hands out a new copy of the setting every time, so that
+ * is the only way to tell it changed; for a header bar, the address of
+ * its string (which Gtk replaces when setting it) must match as well. */
+typedef struct rewritten_layout_t {
+    volatile int valid;
+    const gchar *original;
+    gchar layout[DECORATION_LAYOUT_SIZE];
+} rewritten_layout_t;
+
+static void forget_rewritten_layout (GObject *object, GParamSpec *pspec, gpointer data)
+{
+    rewritten_layout_t *rewritten = data;
+    rewritten->valid = 0;
+}
 
-            g_strfreev (t);
-        }
-        g_strfreev (tokens);
-    } else {
-        g_strlcpy (new_layout, ":", 256);
+/* Returns old_layout without the buttons we don't want, or NULL if it
+ * can't be rewritten. original is what identifies old_layout among
+ * the layouts of object (see above), notify_signal the signal emitted
+ * when it changes. The result belongs to object. */
+static const gchar *rewrite_layout_of (GObject *object, const gchar *notify_signal,
+                                       const gchar *original, const gchar *old_layout)
+{
+    rewritten_layout_t *rewritten = g_object_get_qdata (object, get_quark (&rewritten_layout_quark, "gtk3_nocsd_rewritten_layout"));
+
+    if (G_LIKELY (rewritten && rewritten->valid && rewritten->original == original))
+        return rewritten->layout;
+    if (!rewritten) {
+        rewritten = g_malloc0 (sizeof (rewritten_layout_t));
+        g_object_set_qdata_full (object, get_quark (&rewritten_layout_quark, "gtk3_nocsd_rewritten_layout"), rewritten, g_free);
+        g_signal_connect (object, notify_signal, G_CALLBACK (forget_rewritten_layout), rewritten);
     }
-
-    return 0;
+    rewritten->valid = 0;
+    if (_remove_buttons_from_layout (rewritten->layout, old_layout) < 0)
+        return NULL;
+    rewritten->original = original;
+    rewritten->valid = 1;
+    return rewritten->layout;
 }
 
-static void _gtk_header_bar_update_window_buttons (GtkHeaderBar *bar)
+/* Number of threads that currently fake the global decoration layout
+ * (see g_object_get), so that g_object_get only needs to look at the
+ * per-thread flag while any thread does. */
+static volatile int fake_global_decoration_layout_active = 0;
+
+static void _gtk_header_bar_update_window_buttons_impl (GtkHeaderBar *bar)
 {
     gtk_header_bar_private_info_t info = gtk_header_bar_private_info ();
     char *priv = G_TYPE_INSTANCE_GET_PRIVATE (bar, gtk_header_bar_type, char);
     gchar **decoration_layout_ptr = NULL;
     gchar *orig_layout = NULL;
-    gchar new_layout[256];
-    int r;
+    const gchar *new_layout;
 
     if (info.decoration_layout_offset == (gsize) -1 || info.decoration_layout_offset == (gsize) -2 || !priv) {
         return;
@@ -726,20 +1770,27 @@ static void _gtk_header_bar_update_window_buttons (GtkHeaderBar *bar)
     decoration_layout_ptr = (gchar **) &priv[info.decoration_layout_offset];
     if (*decoration_layout_ptr) {
         orig_layout = *decoration_layout_ptr;
-        r = _remove_buttons_from_layout (new_layout, *decoration_layout_ptr);
-        if (r == 0)
-            *decoration_layout_ptr = new_layout;
-    } else {
-        TLSD->fake_global_decoration_layout = 1;
-    }
-    info.update_window_buttons (bar);
-    if (*decoration_layout_ptr) {
+        new_layout = rewrite_layout_of (G_OBJECT (bar), "notify::decoration-layout", orig_layout, orig_layout);
+        if (new_layout)
+            *decoration_layout_ptr = (gchar *) new_layout;
+        info.update_window_buttons (bar);
         *decoration_layout_ptr = orig_layout;
     } else {
+        __sync_fetch_and_add (&fake_global_decoration_layout_active, 1);
+        TLSD->fake_global_decoration_layout = 1;
+        info.update_window_buttons (bar);
         TLSD->fake_global_decoration_layout = 0;
+        __sync_fetch_and_sub (&fake_global_decoration_layout_active, 1);
     }
 }
 
+static void _gtk_header_bar_update_window_buttons (GtkHeaderBar *bar)
+{
+    unsigned long long start = hook_timer_start ();
+    _gtk_header_bar_update_window_buttons_impl (bar);
+    hook_timer_stop (HOOK_update_window_buttons, start);
+}
+
 static gboolean _gtk_header_bar_window_state_changed (GtkWidget *widget, GdkEventWindowState *event, gpointer data)
 {
     gtk_header_bar_private_info_t info = gtk_header_bar_private_info ();
@@ -772,12 +1823,18 @@ extern void g_object_get (gpointer _object, const gchar *first_property_name, ..
 {
     GObject *object = _object;
     va_list var_args;
+    va_list copy;
     const gchar *name;
-    char new_layout[256];
-    int r;
+    const gchar *new_layout;
+    unsigned long long start;
 
-    if (!G_IS_OBJECT (_object))
+    if (G_UNLIKELY (passthrough)) {
+        va_start (var_args, first_property_name);
+        g_object_get_valist (object, first_property_name, var_args);
+        va_end (var_args);
         return;
+    }
+    start = hook_timer_start ();
 
     /* This is a really, really awful hack, because of the variable arguments
      * that g_object_get takes. At least Gtk+3 defines g_object_get_valist,
@@ -789,45 +1846,48 @@ extern void g_object_get (gpointer _object, const gchar *first_property_name, ..
      * g_object_get(). */
 
     va_start (var_args, first_property_name);
-    if (G_UNLIKELY (TLSD->fake_global_decoration_layout)) {
-        name = first_property_name;
-        while (name) {
-            GValue value = G_VALUE_INIT;
-            GParamSpec *spec = g_object_class_find_property (G_OBJECT_GET_CLASS (object), name);
-            gchar *error;
-
-            if (!spec)
-                break;
-
-            g_value_init (&value, spec->value_type);
-            g_object_get_property (object, name, &value);
-
-            if (G_UNLIKELY (strcmp (name, "gtk-decoration-layout") == 0)) {
-                gchar **v = va_arg (var_args, gchar **);
-                const gchar *s = g_value_get_string (&value);
+    if (G_LIKELY (!fake_global_decoration_layout_active) || !TLSD_PEEK->fake_global_decoration_layout ||
+        !G_IS_OBJECT (_object)) {
+        g_object_get_valist (object, first_property_name, var_args);
+        va_end (var_args);
+        hook_timer_stop (HOOK_g_object_get, start);
+        return;
+    }
 
-                r = _remove_buttons_from_layout (new_layout, s);
-                if (r == 0)
-                    s = new_layout;
-                *v = g_strdup (s);
-            } else {
-                G_VALUE_LCOPY (&value, var_args, 0, &error);
-                if (error) {
-                    g_warning ("%s: %s", "g_object_get_valist", error);
-                    g_free (error);
-                    g_value_unset (&value);
-                    break;
-                }
+    /* Let GObject fetch all properties, then go through the arguments
+     * again and replace the decoration layout, if it was asked for. To
+     * skip the arguments of the other properties, look at how many
+     * pointers their value type wants for collecting. */
+    va_copy (copy, var_args);
+    g_object_get_valist (object, first_property_name, copy);
+    va_end (copy);
+
+    name = first_property_name;
+    while (name) {
+        if (G_UNLIKELY (strcmp (name, "gtk-decoration-layout") == 0)) {
+            gchar **v = va_arg (var_args, gchar **);
+
+            new_layout = rewrite_layout_of (object, "notify::gtk-decoration-layout", NULL, *v);
+            if (new_layout) {
+                g_free (*v);
+                *v = g_strdup (new_layout);
             }
+        } else {
+            GParamSpec *spec = g_object_class_find_property (G_OBJECT_GET_CLASS (object), name);
+            GTypeValueTable *value_table;
+            const gchar *format;
 
-            g_value_unset (&value);
-
-            name = va_arg (var_args, gchar *);
-        }
-    } else {
-        g_object_get_valist (object, first_property_name, var_args);
+            /* GObject already complained about this */
+            if (!spec || !(value_table = g_type_value_table_peek (spec->value_type)))
+                break;
+            for (format = value_table->lcopy_format; *format; format++)
+                (void) va_arg (var_args, gpointer);
+        }
+
+        name = va_arg (var_args, gchar *);
     }
     va_end (var_args);
+    hook_timer_stop (HOOK_g_object_get_fake_layout, start);
 }
 
 extern void gtk_header_bar_set_show_close_button (GtkHeaderBar *bar, gboolean setting)
@@ -836,35 +1896,64 @@ extern void gtk_header_bar_set_show_close_button (GtkHeaderBar *bar, gboolean se
      * but that has adverse consequences, so in newer versions, where the
      * API is more complete, call our own implemnetation of u_w_b after
      * the original routine to perform some fixups. */
-    if(is_compatible_gtk_version() && are_csd_disabled() && !is_gtk_version_larger_or_equal(3, 12, 0))
+    unsigned long long start;
+    if (passthrough & PASSTHROUGH_EXCLUDED) {
+        orig_gtk_header_bar_set_show_close_button (bar, setting);
+        return;
+    }
+    start = hook_timer_start ();
+    if(!GTK3_NOCSD_TARGET_AT_LEAST(3, 12, 0) && is_compatible_gtk_version() && are_csd_disabled() && !GTK_AT_LEAST(3, 12, 0))
         setting = FALSE;
     orig_gtk_header_bar_set_show_close_button (bar, setting);
-    if (is_compatible_gtk_version () && are_csd_disabled () && is_gtk_version_larger_or_equal (3, 12, 0))
+    if (is_compatible_gtk_version () && are_csd_disabled () && GTK_AT_LEAST (3, 12, 0))
         _gtk_header_bar_update_window_buttons (bar);
+    hook_timer_stop (HOOK_gtk_header_bar_set_show_close_button, start);
 }
 
 extern void gtk_header_bar_set_decoration_layout (GtkHeaderBar *bar, const gchar *layout)
 {
     /* We need to call the original routine here, because it modifies the
      * private data structures. We fixup afterwards. */
+    unsigned long long start;
+    if (passthrough & PASSTHROUGH_EXCLUDED) {
+        orig_gtk_header_bar_set_decoration_layout (bar, layout);
+        return;
+    }
+    start = hook_timer_start ();
     orig_gtk_header_bar_set_decoration_layout (bar, layout);
-    if(is_compatible_gtk_version() && are_csd_disabled() && is_gtk_version_larger_or_equal(3, 12, 0)) {
+    if(is_compatible_gtk_version() && are_csd_disabled() && GTK_AT_LEAST(3, 12, 0)) {
         _gtk_header_bar_update_window_buttons (bar);
     }
+    hook_timer_stop (HOOK_gtk_header_bar_set_decoration_layout, start);
 }
 
+#if NEED_COMPOSITE_HACK
 extern gboolean gdk_screen_is_composited (GdkScreen *screen) {
     /* With Gtk+3 3.16.1+ we reimplement gtk_window_set_titlebar ourselves, hence
      * we don't want to re-use the compositing hack, especially since it causes
      * problems in newer Gtk versions. */
-    if(is_compatible_gtk_version() && are_csd_disabled() && !is_gtk_version_larger_or_equal(3, 16, 1)) {
-        if(TLSD->disable_composite)
-            return FALSE;
-    }
-    return orig_gdk_screen_is_composited (screen);
+    unsigned long long start;
+    gboolean result;
+    if (passthrough & PASSTHROUGH_EXCLUDED)
+        return orig_gdk_screen_is_composited (screen);
+    start = hook_timer_start ();
+    if(is_compatible_gtk_version() && are_csd_disabled() && !GTK_AT_LEAST(3, 16, 1) &&
+       TLSD_PEEK->disable_composite)
+        result = FALSE;
+    else
+        result = orig_gdk_screen_is_composited (screen);
+    hook_timer_stop (HOOK_gdk_screen_is_composited, start);
+    return result;
 }
+#endif
 
 extern void gdk_window_set_decorations (GdkWindow *window, GdkWMDecoration decorations) {
+    unsigned long long start;
+    if (passthrough & PASSTHROUGH_EXCLUDED) {
+        orig_gdk_window_set_decorations (window, decorations);
+        return;
+    }
+    start = hook_timer_start ();
     if(is_compatible_gtk_version() && are_csd_disabled()) {
         if(decorations == GDK_DECOR_BORDER) {
             GtkWidget* widget = NULL;
@@ -877,8 +1966,39 @@ extern void gdk_window_set_decorations (GdkWindow *window, GdkWMDecoration decor
         }
     }
     orig_gdk_window_set_decorations (window, decorations);
+    hook_timer_stop (HOOK_gdk_window_set_decorations, start);
+}
+
+static GClassInitFunc orig_gtk_dialog_class_init = NULL;
+static GType gtk_dialog_type = 0;
+static GClassInitFunc orig_gtk_window_class_init = NULL;
+
+static volatile int speculative_probe_scheduled = 0;
+
+/* If GTK3_NOCSD_SPECULATIVE_PROBE is set, probe the layout of Gtk's
+ * private data structures (see probe_private_layout) as soon as the
+ * main loop gets to it after the first window or header bar class has
+ * been initialized, instead of in the first gtk_window_set_titlebar
+ * call, which is on the way to the first frame of the program. If the
+ * title bar is set before the idle source runs, probing happens right
+ * there, as without this option. */
+static void schedule_speculative_probe ()
+{
+    const char *env;
+
+    if (speculative_probe_scheduled)
+        return;
+    env = getenv ("GTK3_NOCSD_SPECULATIVE_PROBE");
+    if (!env || !*env || strcmp (env, "0") == 0)
+        return;
+    if (!is_compatible_gtk_version() || !are_csd_disabled() || !GTK_AT_LEAST(3, 12, 0))
+        return;
+    if (!__sync_bool_compare_and_swap (&speculative_probe_scheduled, 0, 1))
+        return;
+    g_idle_add_full (G_PRIORITY_HIGH_IDLE, speculative_probe, NULL, NULL);
 }
 
+#if NEED_COMPOSITE_HACK
 typedef void (*gtk_window_realize_t)(GtkWidget* widget);
 static gtk_window_realize_t orig_gtk_window_realize = NULL;
 
@@ -889,8 +2009,6 @@ static void fake_gtk_window_realize(GtkWidget* widget) {
 }
 
 static gtk_dialog_constructor_t orig_gtk_dialog_constructor = NULL;
-static GClassInitFunc orig_gtk_dialog_class_init = NULL;
-static GType gtk_dialog_type = 0;
 
 static GObject *fake_gtk_dialog_constructor (GType type, guint n_construct_properties, GObjectConstructParam *construct_params) {
     ++(TLSD->disable_composite);
@@ -909,16 +2027,18 @@ static void fake_gtk_dialog_class_init (GtkDialogClass *klass, gpointer data) {
     }
 }
 
-
-static GClassInitFunc orig_gtk_window_class_init = NULL;
+#endif
 
 static void fake_gtk_window_class_init (GtkWindowClass *klass, gpointer data) {
     orig_gtk_window_class_init(klass, data);
+#if NEED_COMPOSITE_HACK
     GtkWidgetClass* widget_class = GTK_WIDGET_CLASS(klass);
     if(widget_class) {
         orig_gtk_window_realize = widget_class->realize;
         widget_class->realize = fake_gtk_window_realize;
     }
+#endif
+    schedule_speculative_probe ();
 }
 
 static gtk_header_bar_set_property_t orig_gtk_header_bar_set_property = NULL;
@@ -959,9 +2079,9 @@ static void fake_gtk_header_bar_realize (GtkWidget *widget)
     orig_gtk_header_bar_realize (widget);
     settings = gtk_widget_get_settings (widget);
 
-    /* realize() is called from gtk_header_bar_private_info, so make sure
-     * we special-case that. */
-    if (G_UNLIKELY (TLSD->in_info_collect))
+    /* realize() is called while probing (see probe_header_bar_layout),
+     * so make sure we special-case that. */
+    if (G_UNLIKELY (TLSD_PEEK->in_info_collect))
         return;
 
     info = gtk_header_bar_private_info ();
@@ -997,7 +2117,7 @@ static void fake_gtk_header_bar_hierarchy_changed (GtkWidget *widget, GtkWidget
 
     orig_gtk_header_bar_hierarchy_changed (widget, previous_toplevel);
 
-    if (G_UNLIKELY (TLSD->in_info_collect))
+    if (G_UNLIKELY (TLSD_PEEK->in_info_collect))
         return;
 
     toplevel = gtk_widget_get_toplevel (widget);
@@ -1020,6 +2140,7 @@ static void fake_gtk_header_bar_hierarchy_changed (GtkWidget *widget, GtkWidget
 }
 
 static GClassInitFunc orig_gtk_header_bar_class_init = NULL;
+static GtkWidgetClass *gtk_header_bar_parent_class = NULL;
 
 static void fake_gtk_header_bar_class_init (GtkWindowClass *klass, gpointer data) {
     orig_gtk_header_bar_class_init(klass, data);
@@ -1030,6 +2151,7 @@ static void fake_gtk_header_bar_class_init (GtkWindowClass *klass, gpointer data
         object_class->set_property = fake_gtk_header_bar_set_property;
     }
     if (widget_class) {
+        gtk_header_bar_parent_class = g_type_class_peek_parent (widget_class);
         orig_gtk_header_bar_realize = widget_class->realize;
         orig_gtk_header_bar_unrealize = widget_class->unrealize;
         orig_gtk_header_bar_hierarchy_changed = widget_class->hierarchy_changed;
@@ -1037,6 +2159,7 @@ static void fake_gtk_header_bar_class_init (GtkWindowClass *klass, gpointer data
         widget_class->unrealize = fake_gtk_header_bar_unrealize;
         widget_class->hierarchy_changed = fake_gtk_header_bar_hierarchy_changed;
     }
+    schedule_speculative_probe ();
 }
 
 static GInstanceInitFunc orig_gtk_shortcuts_window_init = NULL;
@@ -1062,62 +2185,182 @@ static void fake_gtk_shortcuts_window_init (GtkWindow *window, gpointer klass) {
     }
 }
 
-GType g_type_register_static_simple (GType parent_type, const gchar *type_name, guint class_size, GClassInitFunc class_init, guint instance_size, GInstanceInitFunc instance_init, GTypeFlags flags) {
-    GType type;
-    GType *save_type = NULL;
+/* Everything the type system interposers below have to capture. A bit
+ * is cleared once the thing it stands for has been captured, or once it
+ * is clear that there is nothing to capture (e.g. because the type was
+ * registered by an incompatible Gtk version). Each interposer forwards
+ * directly to GObject as soon as none of the bits it is responsible for
+ * are left, so that types registered afterwards (GIO, plugins, language
+ * bindings, ...) don't pay for our checks anymore. */
+enum {
+    CAPTURE_WINDOW_TYPE             = 1 << 0,
+    CAPTURE_DIALOG_TYPE             = 1 << 1,
+    CAPTURE_HEADER_BAR_TYPE         = 1 << 2,
+    CAPTURE_SHORTCUTS_WINDOW_TYPE   = 1 << 3,
+    CAPTURE_WINDOW_PRIVATE          = 1 << 4,
+    CAPTURE_HEADER_BAR_PRIVATE      = 1 << 5,
+    CAPTURE_WINDOW_BUILDABLE        = 1 << 6,
+    CAPTURE_DIALOG_BUILDABLE        = 1 << 7,
+
+    CAPTURES_REGISTER_TYPE      = CAPTURE_WINDOW_TYPE | CAPTURE_DIALOG_TYPE |
+                                  CAPTURE_HEADER_BAR_TYPE | CAPTURE_SHORTCUTS_WINDOW_TYPE,
+    CAPTURES_INSTANCE_PRIVATE   = CAPTURE_WINDOW_PRIVATE | CAPTURE_HEADER_BAR_PRIVATE,
+    /* Interfaces are also used to detect Gtk2 until GtkWindow has been
+     * registered, see g_type_add_interface_static() */
+    CAPTURES_INTERFACE          = CAPTURE_WINDOW_TYPE | CAPTURE_WINDOW_BUILDABLE | CAPTURE_DIALOG_BUILDABLE,
+    CAPTURES_ALL                = CAPTURES_REGISTER_TYPE | CAPTURES_INSTANCE_PRIVATE | CAPTURES_INTERFACE
+};
 
-    if(!orig_gtk_window_class_init) { // GtkWindow is not overriden
-        if(type_name && G_UNLIKELY(strcmp(type_name, "GtkWindow") == 0)) {
-            // override GtkWindowClass
-            orig_gtk_window_class_init = class_init;
-            detect_gtk2((void *) class_init);
-            if(is_compatible_gtk_version() && are_csd_disabled()) {
-                class_init = (GClassInitFunc)fake_gtk_window_class_init;
-                save_type = &gtk_window_type;
-                goto out;
-            }
-        }
+static volatile int captures_pending = CAPTURES_ALL;
+
+/* If GTK3_NOCSD_UNHOOK is set, point callers that are already bound to
+ * one of the type system interposers back to GObject as soon as that
+ * interposer has nothing left to capture, like layout_probe_finished()
+ * does for g_signal_connect_data. GtkDialog, GtkHeaderBar and
+ * GtkShortcutsWindow are only registered when a program first uses
+ * them, which many never do, so the interposers waiting for them
+ * (g_type_register_static_simple for all three, g_type_add_interface_static
+ * for GtkDialog, g_type_add_instance_private for GtkHeaderBar) often stay
+ * in place. */
+static void type_captured (int what)
+{
+    int before = __sync_fetch_and_and (&captures_pending, ~what);
+    int after = before & ~what;
+
+    if (!(before & what) || !unhook_requested ())
+        return;
+
+    if ((before & CAPTURES_REGISTER_TYPE) && !(after & CAPTURES_REGISTER_TYPE))
+        rebind_symbol ("g_type_register_static_simple", (void *) g_type_register_static_simple,
+                       runtime_import (0, RTLOOKUP_g_type_register_static_simple));
+    if ((before & CAPTURES_INTERFACE) && !(after & CAPTURES_INTERFACE))
+        rebind_symbol ("g_type_add_interface_static", (void *) g_type_add_interface_static,
+                       runtime_import (0, RTLOOKUP_g_type_add_interface_static));
+    if ((before & CAPTURES_INSTANCE_PRIVATE) && !(after & CAPTURES_INSTANCE_PRIVATE))
+        rebind_symbol ("g_type_add_instance_private", (void *) g_type_add_instance_private,
+                       runtime_import (0, RTLOOKUP_g_type_add_instance_private));
+}
+
+/* Types whose class or instance initializers we want to replace,
+ * handled when the type is registered. Every type registered in the
+ * process passes through g_type_register_static_simple(), so the name
+ * lookup needs to reject everything else quickly: the length of the
+ * name is checked against a bit mask of the lengths of all watched
+ * names first, and only names of a watched length are compared. */
+typedef void (*watched_type_hook_t) (GClassInitFunc *class_init, GInstanceInitFunc *instance_init, GType **save_type);
+
+static void watch_gtk_window_type (GClassInitFunc *class_init, GInstanceInitFunc *instance_init, GType **save_type) {
+    if(orig_gtk_window_class_init) // GtkWindow is already overriden
+        return;
+    // override GtkWindowClass
+    orig_gtk_window_class_init = *class_init;
+    detect_gtk2((void *) *class_init);
+    if(is_compatible_gtk_version() && are_csd_disabled()) {
+        *class_init = (GClassInitFunc)fake_gtk_window_class_init;
+        *save_type = &gtk_window_type;
     }
+    type_captured (CAPTURE_WINDOW_TYPE | (*save_type ? 0 : CAPTURE_WINDOW_PRIVATE | CAPTURE_WINDOW_BUILDABLE));
+}
 
-    if(!orig_gtk_dialog_class_init) { // GtkDialog::constructor is not overriden
-        if(type_name && G_UNLIKELY(strcmp(type_name, "GtkDialog") == 0)) {
-            // override GtkDialogClass
-            orig_gtk_dialog_class_init = class_init;
-            detect_gtk2((void *) class_init);
-            if(is_compatible_gtk_version() && are_csd_disabled()) {
-                class_init = (GClassInitFunc)fake_gtk_dialog_class_init;
-                save_type = &gtk_dialog_type;
-                goto out;
-            }
-        }
+static void watch_gtk_dialog_type (GClassInitFunc *class_init, GInstanceInitFunc *instance_init, GType **save_type) {
+    if(orig_gtk_dialog_class_init) // GtkDialog::constructor is already overriden
+        return;
+    // override GtkDialogClass
+    orig_gtk_dialog_class_init = *class_init;
+    detect_gtk2((void *) *class_init);
+    if(is_compatible_gtk_version() && are_csd_disabled()) {
+#if NEED_COMPOSITE_HACK
+        *class_init = (GClassInitFunc)fake_gtk_dialog_class_init;
+#endif
+        *save_type = &gtk_dialog_type;
     }
+    type_captured (CAPTURE_DIALOG_TYPE | (*save_type ? 0 : CAPTURE_DIALOG_BUILDABLE));
+}
 
-    if(!orig_gtk_header_bar_class_init) { // GtkHeaderBar::constructor is not overriden
-        if(type_name && G_UNLIKELY(strcmp(type_name, "GtkHeaderBar") == 0)) {
-            // override GtkHeaderBarClass
-            orig_gtk_header_bar_class_init = class_init;
-            detect_gtk2((void *) class_init);
-            if(is_compatible_gtk_version() && are_csd_disabled()) {
-                class_init = (GClassInitFunc)fake_gtk_header_bar_class_init;
-                save_type = &gtk_header_bar_type;
-                goto out;
-            }
-        }
+static void watch_gtk_header_bar_type (GClassInitFunc *class_init, GInstanceInitFunc *instance_init, GType **save_type) {
+    if(orig_gtk_header_bar_class_init) // GtkHeaderBar::constructor is already overriden
+        return;
+    // override GtkHeaderBarClass
+    orig_gtk_header_bar_class_init = *class_init;
+    detect_gtk2((void *) *class_init);
+    if(is_compatible_gtk_version() && are_csd_disabled()) {
+        *class_init = (GClassInitFunc)fake_gtk_header_bar_class_init;
+        *save_type = &gtk_header_bar_type;
     }
+    type_captured (CAPTURE_HEADER_BAR_TYPE | (*save_type ? 0 : CAPTURE_HEADER_BAR_PRIVATE));
+}
 
-    if(!orig_gtk_shortcuts_window_init) { // GtkShortcutsWindow::constructor is not overriden
-        if(type_name && G_UNLIKELY(strcmp(type_name, "GtkShortcutsWindow") == 0)) {
-            // override GtkShortcutsWindowClass
-            orig_gtk_shortcuts_window_init = instance_init;
-            detect_gtk2((void *) instance_init);
-            if(is_compatible_gtk_version() && are_csd_disabled()) {
-                instance_init = (GInstanceInitFunc) fake_gtk_shortcuts_window_init;
-                goto out;
-            }
-        }
+static void watch_gtk_shortcuts_window_type (GClassInitFunc *class_init, GInstanceInitFunc *instance_init, GType **save_type) {
+    if(orig_gtk_shortcuts_window_init) // GtkShortcutsWindow::constructor is already overriden
+        return;
+    // override GtkShortcutsWindowClass
+    orig_gtk_shortcuts_window_init = *instance_init;
+    detect_gtk2((void *) *instance_init);
+    if(is_compatible_gtk_version() && are_csd_disabled())
+        *instance_init = (GInstanceInitFunc) fake_gtk_shortcuts_window_init;
+    type_captured (CAPTURE_SHORTCUTS_WINDOW_TYPE);
+}
+
+#define WATCHED_TYPES(X) \
+    X("GtkWindow",          watch_gtk_window_type) \
+    X("GtkDialog",          watch_gtk_dialog_type) \
+    X("GtkHeaderBar",       watch_gtk_header_bar_type) \
+    X("GtkShortcutsWindow", watch_gtk_shortcuts_window_type)
+
+typedef struct watched_type_t {
+    const char *name;
+    size_t length;
+    watched_type_hook_t hook;
+} watched_type_t;
+
+#define WATCHED_TYPE_LENGTH_BIT(name, hook) | (1ULL << (sizeof (name) - 1))
+#define WATCHED_TYPE_ENTRY(name, hook)      { name, sizeof (name) - 1, hook },
+#define WATCHED_TYPE_MAX_LENGTH             63
+
+static const unsigned long long watched_type_lengths = 0 WATCHED_TYPES(WATCHED_TYPE_LENGTH_BIT);
+
+static const watched_type_t watched_types[] = {
+    WATCHED_TYPES(WATCHED_TYPE_ENTRY)
+    { NULL, 0, NULL }
+};
+
+static const watched_type_t *find_watched_type (const gchar *type_name)
+{
+    const watched_type_t *watched;
+    size_t length;
+
+    if (!type_name)
+        return NULL;
+    for (length = 0; type_name[length]; length++) {
+        if (length == WATCHED_TYPE_MAX_LENGTH)
+            return NULL;
+    }
+    if (G_LIKELY (!(watched_type_lengths & (1ULL << length))))
+        return NULL;
+    for (watched = watched_types; watched->name; watched++) {
+        if (watched->length == length && memcmp (watched->name, type_name, length) == 0)
+            return watched;
     }
+    return NULL;
+}
+
+GType g_type_register_static_simple (GType parent_type, const gchar *type_name, guint class_size, GClassInitFunc class_init, guint instance_size, GInstanceInitFunc instance_init, GTypeFlags flags) {
+    const watched_type_t *watched;
+    GType type;
+    GType *save_type = NULL;
+
+    if (G_UNLIKELY (passthrough)) {
+        if ((passthrough & PASSTHROUGH_EXCLUDED) || !type_name || strncmp (type_name, "Gtk", 3) != 0)
+            return orig_g_type_register_static_simple (parent_type, type_name, class_size, class_init, instance_size, instance_init, flags);
+        leave_no_gtk_passthrough ();
+    }
+    if (!(captures_pending & CAPTURES_REGISTER_TYPE))
+        return orig_g_type_register_static_simple (parent_type, type_name, class_size, class_init, instance_size, instance_init, flags);
+
+    watched = find_watched_type (type_name);
+    if (G_UNLIKELY (watched))
+        watched->hook (&class_init, &instance_init, &save_type);
 
-out:
     type = orig_g_type_register_static_simple (parent_type, type_name, class_size, class_init, instance_size, instance_init, flags);
     if (save_type)
         *save_type = type;
@@ -1163,11 +2406,19 @@ static void fake_gtk_dialog_buildable_interface_init (GtkBuildableIface *iface,
 }
 
 void g_type_add_interface_static (GType instance_type, GType interface_type, const GInterfaceInfo *info) {
-    if (info && info->interface_init)
+    if (G_UNLIKELY (passthrough) || !(captures_pending & CAPTURES_INTERFACE)) {
+        orig_g_type_add_interface_static (instance_type, interface_type, info);
+        return;
+    }
+
+    /* Type names are unique, so once GtkWindow has been registered (and
+     * its class_init looked at), it's known which Gtk version is used. */
+    if ((captures_pending & CAPTURE_WINDOW_TYPE) && info && info->interface_init)
         detect_gtk2((void *) info->interface_init);
 
-    if(is_compatible_gtk_version() && are_csd_disabled() && (instance_type == gtk_window_type || instance_type == gtk_dialog_type)) {
-        if(interface_type == GTK_TYPE_BUILDABLE) {
+    if((instance_type == gtk_window_type || instance_type == gtk_dialog_type) && interface_type == GTK_TYPE_BUILDABLE) {
+        int what = instance_type == gtk_window_type ? CAPTURE_WINDOW_BUILDABLE : CAPTURE_DIALOG_BUILDABLE;
+        if(is_compatible_gtk_version() && are_csd_disabled()) {
             // register GtkBuildable interface for GtkWindow/GtkDialog class
             GInterfaceInfo fake_info = *info;
             if (instance_type == gtk_window_type) {
@@ -1178,8 +2429,10 @@ void g_type_add_interface_static (GType instance_type, GType interface_type, con
                 fake_info.interface_init = (GInterfaceInitFunc)fake_gtk_dialog_buildable_interface_init;
             }
             orig_g_type_add_interface_static (instance_type, interface_type, &fake_info);
+            type_captured (what);
             return;
         }
+        type_captured (what);
     }
     orig_g_type_add_interface_static (instance_type, interface_type, info);
 }
@@ -1190,26 +2443,76 @@ static gsize gtk_header_bar_private_size = 0;
 static gint gtk_header_bar_private_offset = 0;
 gint g_type_add_instance_private (GType class_type, gsize private_size)
 {
+    if (G_UNLIKELY (passthrough) || !(captures_pending & CAPTURES_INSTANCE_PRIVATE))
+        return orig_g_type_add_instance_private (class_type, private_size);
     if (G_UNLIKELY (class_type == gtk_window_type && gtk_window_private_size == 0)) {
         gtk_window_private_size = private_size;
         gtk_window_private_offset = orig_g_type_add_instance_private (class_type, private_size);
+        type_captured (CAPTURE_WINDOW_PRIVATE);
         return gtk_window_private_offset;
     } else if (G_UNLIKELY (class_type == gtk_header_bar_type && gtk_header_bar_private_size == 0)) {
         gtk_header_bar_private_size = private_size;
         gtk_header_bar_private_offset = orig_g_type_add_instance_private (class_type, private_size);
+        type_captured (CAPTURE_HEADER_BAR_PRIVATE);
         return gtk_window_private_offset;
     }
     return orig_g_type_add_instance_private (class_type, private_size);
 }
 
+/* Number of threads that currently capture a signal handler (see
+ * begin_signal_capture). g_signal_connect_data is one of the hottest
+ * functions in GObject, so don't even look at the per-thread state
+ * unless some thread is currently probing. */
+static volatile int signal_capture_active = 0;
+
+/* Capture the handlers of all count signals in captures (at once) until
+ * end_signal_capture is called. */
+static void begin_signal_capture (signal_capture_t *captures, int count)
+{
+    gtk3_nocsd_tls_data_t *tls = TLSD;
+    int i;
+
+    for (i = 0; i < count; i++)
+        captures[i].callback = NULL;
+    tls->signal_captures = captures;
+    tls->signal_capture_count = count;
+    __sync_fetch_and_add (&signal_capture_active, 1);
+}
+
+static void end_signal_capture ()
+{
+    gtk3_nocsd_tls_data_t *tls = TLSD;
+
+    __sync_fetch_and_sub (&signal_capture_active, 1);
+    tls->signal_capture_count = 0;
+    tls->signal_captures = NULL;
+}
+
+static void capture_signal_handler (gpointer instance, const gchar *detailed_signal, GCallback c_handler, gpointer data)
+{
+    gtk3_nocsd_tls_data_t *tls = TLSD;
+    signal_capture_t *capture;
+    int i;
+
+    for (i = 0; i < tls->signal_capture_count; i++) {
+        capture = &tls->signal_captures[i];
+        if (((instance != NULL && capture->instance == instance) || (data != NULL && capture->data == data))
+            && strcmp (detailed_signal, capture->name) == 0)
+            capture->callback = c_handler;
+    }
+}
+
 gulong g_signal_connect_data (gpointer instance, const gchar *detailed_signal, GCallback c_handler, gpointer data, GClosureNotify destroy_data, GConnectFlags connect_flags)
 {
-    if (G_UNLIKELY (TLSD->signal_capture_handler)) {
-        const char *name = TLSD->signal_capture_name;
-        if (instance != NULL && TLSD->signal_capture_instance == instance && strcmp (detailed_signal, name) == 0)
-            TLSD->signal_capture_callback = c_handler;
-        else if (data != NULL && TLSD->signal_capture_data == data && strcmp (detailed_signal, name) == 0)
-            TLSD->signal_capture_callback = c_handler;
+    if (G_UNLIKELY (passthrough))
+        return orig_g_signal_connect_data (instance, detailed_signal, c_handler, data, destroy_data, connect_flags);
+    if (G_UNLIKELY (signal_capture_active) && TLSD_PEEK->signal_capture_count)
+        capture_signal_handler (instance, detailed_signal, c_handler, data);
+    if (G_UNLIKELY (stats_enabled)) {
+        unsigned long long start = hook_timer_start ();
+        gulong id = orig_g_signal_connect_data (instance, detailed_signal, c_handler, data, destroy_data, connect_flags);
+        hook_timer_stop (HOOK_g_signal_connect_data, start);
+        return id;
     }
     return orig_g_signal_connect_data (instance, detailed_signal, c_handler, data, destroy_data, connect_flags);
 }
@@ -1233,184 +2536,608 @@ static int find_unique_pointer_in_region (const char *haystack, gsize haystack_s
     return offset;
 }
 
-static gtk_window_private_info_t gtk_window_private_info ()
+enum {
+    LAYOUT_PROBE_WINDOW     = 1 << 0,
+    LAYOUT_PROBE_HEADER_BAR = 1 << 1,
+    LAYOUT_PROBES_ALL       = LAYOUT_PROBE_WINDOW | LAYOUT_PROBE_HEADER_BAR
+};
+
+/* Everything probe_private_layout (see below) determines; probed says
+ * which of the parts are valid. */
+typedef struct gtk_private_layout_t {
+    int probed;
+    gtk_window_private_info_t window;
+    gtk_header_bar_private_info_t header_bar;
+} gtk_private_layout_t;
+
+/* Probing the private structure layout (see below) requires creating
+ * dummy widgets and is done on the first title bar of every process.
+ * The result only depends on the Gtk library binary, so it is stored
+ * in a small cache file under $XDG_CACHE_HOME/gtk3-nocsd, keyed by the
+ * build-id of libgtk-3 and validated against the private structure
+ * sizes seen in g_type_add_instance_private. Callbacks are stored as
+ * offsets relative to the library's load address, because of ASLR.
+ * Set GTK3_NOCSD_NO_CACHE to bypass the cache completely. */
+#define LAYOUT_CACHE_MAGIC          "G3NOCSD"
+#define LAYOUT_CACHE_VERSION        1
+#define LAYOUT_CACHE_BUILD_ID_MAX   64
+
+enum {
+    LAYOUT_CACHE_HAS_WINDOW     = 1 << 0,
+    LAYOUT_CACHE_HAS_HEADER_BAR = 1 << 1
+};
+
+typedef struct gtk3_nocsd_layout_cache_t {
+    char magic[8];
+    guint32 version;
+    guint32 build_id_len;
+    unsigned char build_id[LAYOUT_CACHE_BUILD_ID_MAX];
+    guint32 flags;
+    guint32 pointer_size;
+    guint64 window_private_size;
+    guint64 title_box_offset;
+    guint64 on_titlebar_title_notify;
+    guint64 header_bar_private_size;
+    guint64 decoration_layout_offset;
+    guint64 update_window_buttons;
+    guint64 window_state_changed;
+} gtk3_nocsd_layout_cache_t;
+
+typedef struct gtk_library_image_t {
+    const void *pointer;
+    int found;
+    uintptr_t base;
+    uintptr_t text_start;
+    uintptr_t text_end;
+    guint32 build_id_len;
+    unsigned char build_id[LAYOUT_CACHE_BUILD_ID_MAX];
+} gtk_library_image_t;
+
+static pthread_once_t layout_cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t layout_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static gtk_library_image_t layout_cache_image;
+static gtk3_nocsd_layout_cache_t layout_cache;
+static int layout_cache_usable;
+
+static int find_gtk_library_image_callback (struct dl_phdr_info *info, size_t size, void *data)
 {
-    static volatile gtk_window_private_info_t info = { (gsize) -1, NULL };
-    if (G_UNLIKELY (info.title_box_offset == (gsize) -1)) {
-        if (gtk_window_private_size != 0) {
-            /* We have to detect the offset of where the title_box pointer
-             * is stored in a GtkWindowPrivate object. This is required
-             * because we need to change the pointer inside
-             * GtkWindowPrivate causing any side effects (especially
-             * without enabling CSD) - and the set_titlebar function will
-             * enable CSD (in >= 3.16.1) if any non-NULL titlebar is set.
-             * Therefore, we need to find the pointer offset within the
-             * private data at runtime (it's not guaranteed to be stable
-             * ABI-wise, so we can't just hard-code things, that would
-             * lead to crashes). Furthermore, we need to know the address
-             * of the static callback function that's used to process the
-             * notify::title signal emitted by header bars.
-             *
-             * The basic algorithm is as follows: create a dummy GtkWindow,
-             * create a dummy GtkHeaderBar, call the original
-             * gtk_window_set_titlebar function and then look for the pointer
-             * in the private data region of the GtkWindow. The size of the
-             * region was recorded by us when the type was registered, so we
-             * will stay within the proper memory region.
-             */
-            GtkWindow *dummy_window = GTK_WINDOW (gtk_window_new (GTK_WINDOW_TOPLEVEL));
-            void *window_priv = NULL;
-            GtkHeaderBar *dummy_bar = GTK_HEADER_BAR (gtk_header_bar_new ());
-            int offset = -1;
-
-            /* We're collecting information, so make sure all hacks
-             * are NOOPS. */
-            TLSD->in_info_collect = 1;
-
-            if (!dummy_window || !dummy_bar) {
-                g_warning ("libgtk3-nocsd: couldn't create dummy objects (GtkWindow, GtkHeaderBar) to determine this Gtk's runtime data structure layout");
-                goto out;
+    gtk_library_image_t *image = data;
+    uintptr_t start, end;
+    ElfW(Half) n;
+    int contains = 0;
+
+    for (n = 0; n < info->dlpi_phnum; n++) {
+        if (info->dlpi_phdr[n].p_type != PT_LOAD)
+            continue;
+        start = (uintptr_t) (info->dlpi_addr + info->dlpi_phdr[n].p_vaddr);
+        end   = start + (uintptr_t) info->dlpi_phdr[n].p_memsz;
+        if ((uintptr_t) image->pointer >= start && (uintptr_t) image->pointer < end) {
+            contains = 1;
+            break;
+        }
+    }
+    if (!contains)
+        return 0;
+
+    image->found = 1;
+    image->base = (uintptr_t) info->dlpi_addr;
+    image->text_start = UINTPTR_MAX;
+    image->text_end = 0;
+    image->build_id_len = 0;
+
+    for (n = 0; n < info->dlpi_phnum; n++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[n];
+
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+            start = (uintptr_t) (info->dlpi_addr + phdr->p_vaddr);
+            end   = start + (uintptr_t) phdr->p_memsz;
+            if (start < image->text_start)
+                image->text_start = start;
+            if (end > image->text_end)
+                image->text_end = end;
+        } else if (phdr->p_type == PT_NOTE && image->build_id_len == 0) {
+            const char *p = (const char *) (info->dlpi_addr + phdr->p_vaddr);
+            const char *note_end = p + phdr->p_memsz;
+            size_t align = phdr->p_align == 8 ? 8 : 4;
+
+            while (p + sizeof (ElfW(Nhdr)) <= note_end) {
+                const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *) p;
+                const char *name = p + sizeof (ElfW(Nhdr));
+                const char *desc = name + ((nhdr->n_namesz + align - 1) & ~(align - 1));
+
+                if (desc + nhdr->n_descsz > note_end)
+                    break;
+                if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp (name, "GNU", 4) == 0) {
+                    if (nhdr->n_descsz > 0 && nhdr->n_descsz <= LAYOUT_CACHE_BUILD_ID_MAX) {
+                        memcpy (image->build_id, desc, nhdr->n_descsz);
+                        image->build_id_len = nhdr->n_descsz;
+                    }
+                    break;
+                }
+                p = desc + ((nhdr->n_descsz + align - 1) & ~(align - 1));
             }
+        }
+    }
+    return 1;
+}
 
-            /* First let's try to make sure the pointer is not present in
-             * the memory region. */
-            window_priv = G_TYPE_INSTANCE_GET_PRIVATE (dummy_window, gtk_window_type, void);
-            offset = find_unique_pointer_in_region (window_priv, gtk_window_private_size, dummy_bar);
-            /* Make sure the pointer isn't in there, else */
-            if (offset != -1) {
-                g_warning ("libgtk3-nocsd: error trying to determine this Gtk's runtime data structure layout: GtkWindow private structure already contained a pointer to GtkHeaderBar before setting title bar");
-                goto out;
-            }
+static int layout_cache_path (char *path, size_t path_size, int create_dir)
+{
+    const char *cache_home = getenv ("XDG_CACHE_HOME");
+    char dir[PATH_MAX];
+    char hex[LAYOUT_CACHE_BUILD_ID_MAX * 2 + 1];
+    guint32 i;
+    int r;
 
-            /* Set the title bar via the original title bar function. */
-            TLSD->signal_capture_callback = NULL;
-            TLSD->signal_capture_handler = 1;
-            TLSD->signal_capture_name = "notify::title";
-            TLSD->signal_capture_instance = dummy_bar;
-            TLSD->signal_capture_data = NULL;
-            orig_gtk_window_set_titlebar (dummy_window, GTK_WIDGET (dummy_bar));
-            TLSD->signal_capture_handler = 0;
-            TLSD->signal_capture_instance = NULL;
-            TLSD->signal_capture_name = NULL;
-
-            /* Now find the pointer in memory. */
-            offset = find_unique_pointer_in_region (window_priv, gtk_window_private_size, dummy_bar);
-            if (offset < 0) {
-                g_warning ("libgtk3-nocsd: error trying to determine this Gtk's runtime data structure layout: GtkWindow private structure doesn't contain a pointer to GtkHeaderBar after setting title bar (error type %d)", -offset);
-                goto out;
-            }
+    if (cache_home && cache_home[0] == '/') {
+        r = snprintf (dir, sizeof (dir), "%s/gtk3-nocsd", cache_home);
+    } else {
+        const char *home = getenv ("HOME");
+        if (!home || home[0] != '/')
+            return -1;
+        r = snprintf (dir, sizeof (dir), "%s/.cache/gtk3-nocsd", home);
+    }
+    if (r < 0 || (size_t) r >= sizeof (dir))
+        return -1;
 
-            if (TLSD->signal_capture_callback == NULL) {
-                g_warning ("libgtk3-nocsd: error trying to determine this Gtk's callback routine for GtkHeaderBar/GtkWindow interaction");
-                goto out;
-            }
+    if (create_dir) {
+        /* Parent first, in case $XDG_CACHE_HOME doesn't exist yet. */
+        char *slash = strrchr (dir, '/');
+        *slash = '\0';
+        if (mkdir (dir, 0700) < 0 && errno != EEXIST)
+            return -1;
+        *slash = '/';
+        if (mkdir (dir, 0700) < 0 && errno != EEXIST)
+            return -1;
+    }
 
-            info.on_titlebar_title_notify = (on_titlebar_title_notify_t) TLSD->signal_capture_callback;
-            info.title_box_offset = offset;
-out:
-            if (dummy_window) gtk_widget_destroy (GTK_WIDGET (dummy_window));
-            else if (dummy_bar) gtk_widget_destroy (GTK_WIDGET (dummy_bar));
+    for (i = 0; i < layout_cache_image.build_id_len; i++)
+        snprintf (&hex[i * 2], 3, "%02x", layout_cache_image.build_id[i]);
+    hex[i * 2] = '\0';
+
+    r = snprintf (path, path_size, "%s/layout-v%d-%s", dir, LAYOUT_CACHE_VERSION, hex);
+    if (r < 0 || (size_t) r >= path_size)
+        return -1;
+    return 0;
+}
+
+static void layout_cache_load ()
+{
+    gtk3_nocsd_layout_cache_t entry;
+    char path[PATH_MAX];
+    ssize_t n;
+    int fd;
+
+    if (getenv ("GTK3_NOCSD_NO_CACHE"))
+        return;
+
+    /* The class init function we replaced always lives within the
+     * Gtk library itself. */
+    layout_cache_image.pointer = (const void *) orig_gtk_window_class_init;
+    if (!layout_cache_image.pointer)
+        return;
+    dl_iterate_phdr (find_gtk_library_image_callback, &layout_cache_image);
+    if (!layout_cache_image.found || layout_cache_image.build_id_len == 0 || layout_cache_image.text_start >= layout_cache_image.text_end)
+        return;
+
+    memset (&layout_cache, 0, sizeof (layout_cache));
+    memcpy (layout_cache.magic, LAYOUT_CACHE_MAGIC, sizeof (layout_cache.magic));
+    layout_cache.version = LAYOUT_CACHE_VERSION;
+    layout_cache.pointer_size = sizeof (void *);
+    layout_cache.build_id_len = layout_cache_image.build_id_len;
+    memcpy (layout_cache.build_id, layout_cache_image.build_id, layout_cache_image.build_id_len);
+    layout_cache_usable = 1;
+
+    if (layout_cache_path (path, sizeof (path), 0) < 0)
+        return;
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    n = read (fd, &entry, sizeof (entry));
+    close (fd);
+
+    if (n != (ssize_t) sizeof (entry)
+        || memcmp (entry.magic, layout_cache.magic, sizeof (entry.magic)) != 0
+        || entry.version != LAYOUT_CACHE_VERSION
+        || entry.pointer_size != sizeof (void *)
+        || entry.build_id_len != layout_cache.build_id_len
+        || memcmp (entry.build_id, layout_cache.build_id, entry.build_id_len) != 0)
+        return;
+
+    layout_cache = entry;
+}
+
+static gpointer layout_cache_function (guint64 offset)
+{
+    uintptr_t address;
+
+    /* 0 means that the callback wasn't found (which is allowed for
+     * window_state_changed); anything else must point into the text
+     * segment of the library, otherwise the entry is garbage. */
+    if (offset == 0)
+        return NULL;
+    address = layout_cache_image.base + (uintptr_t) offset;
+    if (address < layout_cache_image.text_start || address >= layout_cache_image.text_end)
+        return (gpointer) -1;
+    return (gpointer) address;
+}
+
+static guint64 layout_cache_function_offset (gpointer function)
+{
+    if (!function)
+        return 0;
+    return (guint64) ((uintptr_t) function - layout_cache_image.base);
+}
+
+static void layout_cache_save ()
+{
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 8];
+    ssize_t n;
+    int fd;
 
-            TLSD->in_info_collect = 0;
+    if (layout_cache_path (path, sizeof (path), 1) < 0)
+        return;
+    snprintf (tmp_path, sizeof (tmp_path), "%s.XXXXXX", path);
+    fd = mkstemp (tmp_path);
+    if (fd < 0)
+        return;
+    n = write (fd, &layout_cache, sizeof (layout_cache));
+    if (close (fd) < 0 || n != (ssize_t) sizeof (layout_cache) || rename (tmp_path, path) < 0)
+        unlink (tmp_path);
+}
+
+/* Fill in those of the parts (LAYOUT_PROBE_*) of layout that the
+ * cache has a valid entry for, and return which ones that were. */
+static int layout_cache_get (gtk_private_layout_t *layout, int parts)
+{
+    gpointer title_cb, update_cb, state_cb;
+    int found = 0;
+
+    (void) pthread_once (&layout_cache_once, layout_cache_load);
+    if (!layout_cache_usable)
+        return 0;
+
+    pthread_mutex_lock (&layout_cache_mutex);
+    if ((parts & LAYOUT_PROBE_WINDOW)
+        && (layout_cache.flags & LAYOUT_CACHE_HAS_WINDOW)
+        && layout_cache.window_private_size == gtk_window_private_size
+        && layout_cache.title_box_offset + sizeof (gpointer) <= gtk_window_private_size) {
+        title_cb = layout_cache_function (layout_cache.on_titlebar_title_notify);
+        if (title_cb && title_cb != (gpointer) -1) {
+            layout->window.title_box_offset = (gsize) layout_cache.title_box_offset;
+            layout->window.on_titlebar_title_notify = (on_titlebar_title_notify_t) title_cb;
+            found |= LAYOUT_PROBE_WINDOW;
+        }
+    }
+    if ((parts & LAYOUT_PROBE_HEADER_BAR)
+        && (layout_cache.flags & LAYOUT_CACHE_HAS_HEADER_BAR)
+        && layout_cache.header_bar_private_size == gtk_header_bar_private_size
+        && layout_cache.decoration_layout_offset + sizeof (gpointer) <= gtk_header_bar_private_size) {
+        update_cb = layout_cache_function (layout_cache.update_window_buttons);
+        state_cb = layout_cache_function (layout_cache.window_state_changed);
+        if (update_cb && update_cb != (gpointer) -1 && state_cb != (gpointer) -1) {
+            layout->header_bar.decoration_layout_offset = (gsize) layout_cache.decoration_layout_offset;
+            layout->header_bar.update_window_buttons = (update_window_buttons_t) update_cb;
+            layout->header_bar.window_state_changed = (window_state_changed_t) state_cb;
+            found |= LAYOUT_PROBE_HEADER_BAR;
         }
     }
-    return info;
+    pthread_mutex_unlock (&layout_cache_mutex);
+    return found;
 }
 
-static gtk_header_bar_private_info_t gtk_header_bar_private_info ()
+/* Store the given parts of layout in the cache (with a single write). */
+static void layout_cache_put (const gtk_private_layout_t *layout, int parts)
 {
-    static volatile gtk_header_bar_private_info_t info = { (gsize) -1, NULL };
-    if (G_UNLIKELY (info.decoration_layout_offset == (gsize) -1)) {
-        /* Was only introduced in Gtk+3 >= 3.12. Unlikely that someone is
-         * still using such an old version, but be safe nevertheless. */
-        if (G_UNLIKELY (!is_gtk_version_larger_or_equal(3, 12, 0))) {
-            return info;
-        }
-        if (gtk_header_bar_private_size != 0) {
-            /* We want to detect the offset of the pointer for the
-             * decoration_layout string in the private structure, so we
-             * create a header bar and set a decoration layout. As the
-             * setter does g_strdup, we have to call the getter again,
-             * because that will return the actual pointer that's stored.
-             */
-            GtkWindow *dummy_window = GTK_WINDOW (gtk_window_new (GTK_WINDOW_TOPLEVEL));
-            GtkHeaderBar *dummy_bar = GTK_HEADER_BAR (gtk_header_bar_new ());
-            void *header_bar_priv = NULL;
-            const gchar *ptr = NULL;
-            const gchar **ptr_in_priv;
-            int offset = -1;
-            gpointer ws_cb = NULL;
-
-            /* We're collecting information, so make sure all hacks
-             * are NOOPS. */
-            TLSD->in_info_collect = 1;
-
-            if (!dummy_bar || !dummy_window) {
-                g_warning ("libgtk3-nocsd: couldn't create dummy object (GtkHeaderBar) to determine this Gtk's runtime data structure layout");
-                goto out;
-            }
+    (void) pthread_once (&layout_cache_once, layout_cache_load);
+    if (!layout_cache_usable)
+        return;
 
-            /* add it to our dummy window (we need a window here because
-             * we want to realize the header bar, and that we can only
-             * do if it's attached to a top-level window) */
-            TLSD->signal_capture_callback = NULL;
-            TLSD->signal_capture_handler = 1;
-            TLSD->signal_capture_name = "window-state-event";
-            TLSD->signal_capture_instance = dummy_window;
-            TLSD->signal_capture_data = NULL;
-            orig_gtk_window_set_titlebar (dummy_window, GTK_WIDGET (dummy_bar));
-            TLSD->signal_capture_handler = 0;
-            TLSD->signal_capture_instance = NULL;
-            TLSD->signal_capture_name = NULL;
-            ws_cb = TLSD->signal_capture_callback;
-
-            header_bar_priv = G_TYPE_INSTANCE_GET_PRIVATE (dummy_bar, gtk_header_bar_type, void);
-
-            orig_gtk_header_bar_set_decoration_layout (dummy_bar, "menu:close");
-            ptr = orig_gtk_header_bar_get_decoration_layout (dummy_bar);
-            offset = find_unique_pointer_in_region (header_bar_priv, gtk_header_bar_private_size, ptr);
-            if (offset < 0) {
-                g_warning ("libgtk3-nocsd: error trying to determine this Gtk's runtime data structure layout: GtkHeaderBar private structure doesn't contain a pointer to decoration_layout after setting it (error type %d)", -offset);
-                goto out;
-            }
+    pthread_mutex_lock (&layout_cache_mutex);
+    if (parts & LAYOUT_PROBE_WINDOW) {
+        layout_cache.window_private_size = gtk_window_private_size;
+        layout_cache.title_box_offset = layout->window.title_box_offset;
+        layout_cache.on_titlebar_title_notify = layout_cache_function_offset ((gpointer) layout->window.on_titlebar_title_notify);
+        layout_cache.flags |= LAYOUT_CACHE_HAS_WINDOW;
+    }
+    if (parts & LAYOUT_PROBE_HEADER_BAR) {
+        layout_cache.header_bar_private_size = gtk_header_bar_private_size;
+        layout_cache.decoration_layout_offset = layout->header_bar.decoration_layout_offset;
+        layout_cache.update_window_buttons = layout_cache_function_offset ((gpointer) layout->header_bar.update_window_buttons);
+        layout_cache.window_state_changed = layout_cache_function_offset ((gpointer) layout->header_bar.window_state_changed);
+        layout_cache.flags |= LAYOUT_CACHE_HAS_HEADER_BAR;
+    }
+    layout_cache_save ();
+    pthread_mutex_unlock (&layout_cache_mutex);
+}
 
-            /* We now verify that the pointer is NULL */
-            orig_gtk_header_bar_set_decoration_layout (dummy_bar, NULL);
-            ptr_in_priv = (const gchar **) &((char *)header_bar_priv)[offset];
-            if (*ptr_in_priv != NULL) {
-                g_warning ("libgtk3-nocsd: error trying to determine this Gtk's runtime data structure layout: GtkHeaderBar's priv->decoration_layout pointer position sanity check failed (got pointer %p instead of NULL)", *ptr_in_priv);
-                goto out;
-            }
+static volatile int layout_probes_done = 0;
 
-            /* realize the widget to capture the
-             * _gtk_header_bar_update_window_buttons callback */
-            TLSD->signal_capture_callback = NULL;
-            TLSD->signal_capture_handler = 1;
-            TLSD->signal_capture_name = "notify::gtk-decoration-layout";
-            TLSD->signal_capture_instance = NULL;
-            TLSD->signal_capture_data = dummy_bar;
-            gtk_widget_realize (GTK_WIDGET (dummy_bar));
-            TLSD->signal_capture_handler = 0;
-            TLSD->signal_capture_data = NULL;
-            TLSD->signal_capture_name = NULL;
-
-            if (TLSD->signal_capture_callback == NULL) {
-                g_warning ("libgtk3-nocsd: error trying to determine this Gtk's callback routine for GtkHeaderBar's button update");
-                goto out;
-            }
+/* g_signal_connect_data is only interposed to capture callbacks while
+ * probing. If GTK3_NOCSD_UNHOOK is set, point all callers that are
+ * already bound to us back to the original function once both probes
+ * have completed, so later connections don't go through us at all. */
+static void layout_probe_finished (int probe)
+{
+    int before = __sync_fetch_and_or (&layout_probes_done, probe);
 
-            info.decoration_layout_offset = offset;
-            info.update_window_buttons = (update_window_buttons_t) TLSD->signal_capture_callback;
-            /* Don't check ws_cb, it may be NULL, because older Gtk+3 versions didn't use that. */
-            info.window_state_changed = (window_state_changed_t) ws_cb;
-out:
-            if (dummy_window) gtk_widget_destroy (GTK_WIDGET (dummy_window));
-            else if (dummy_bar) gtk_widget_destroy (GTK_WIDGET (dummy_bar));
+    if ((before | probe) != LAYOUT_PROBES_ALL || before == LAYOUT_PROBES_ALL)
+        return;
+    if (!unhook_requested ())
+        return;
+
+    rebind_symbol ("g_signal_connect_data", (void *) g_signal_connect_data,
+                   runtime_import (0, RTLOOKUP_g_signal_connect_data));
+}
+
+/* While probing, the realize function of GtkHeaderBar's parent class is
+ * replaced with this one, which does nothing for the dummy header bar,
+ * so GtkHeaderBar's realize can be run without creating a GdkWindow (or
+ * realizing the dummy window first, as gtk_widget_realize would): that
+ * would cost a few round trips to the X server at startup. Classes
+ * initialized while probing may inherit this function, so it keeps
+ * forwarding everything else to the original one. */
+static gtk_header_bar_realize_t probe_saved_parent_realize = NULL;
+static GtkWidget *volatile probe_realize_widget = NULL;
+
+static void probe_parent_realize (GtkWidget *widget)
+{
+    if (widget != probe_realize_widget)
+        probe_saved_parent_realize (widget);
+}
+
+static void realize_header_bar_without_window (GtkHeaderBar *bar)
+{
+    if (gtk_header_bar_parent_class->realize != probe_parent_realize)
+        probe_saved_parent_realize = gtk_header_bar_parent_class->realize;
+    probe_realize_widget = GTK_WIDGET (bar);
+    gtk_header_bar_parent_class->realize = probe_parent_realize;
+    orig_gtk_header_bar_realize (GTK_WIDGET (bar));
+    gtk_header_bar_parent_class->realize = probe_saved_parent_realize;
+    probe_realize_widget = NULL;
+}
+
+/* The header bar part of probe_private_layout, once the dummy header bar
+ * has been set as the title bar of the dummy window (ws_cb is what was
+ * captured for window-state-event while doing that). */
+static int probe_header_bar_layout (GtkHeaderBar *dummy_bar, GCallback ws_cb, gtk_header_bar_private_info_t *info)
+{
+    void *header_bar_priv = G_TYPE_INSTANCE_GET_PRIVATE (dummy_bar, gtk_header_bar_type, void);
+    signal_capture_t capture = { "notify::gtk-decoration-layout", NULL, dummy_bar, NULL };
+    const gchar *ptr = NULL;
+    const gchar **ptr_in_priv;
+    GtkSettings *settings;
+    int offset;
 
-            TLSD->in_info_collect = 0;
+    /* We want to detect the offset of the pointer for the
+     * decoration_layout string in the private structure, so we
+     * set a decoration layout. As the setter does g_strdup, we
+     * have to call the getter again, because that will return
+     * the actual pointer that's stored.
+     */
+    orig_gtk_header_bar_set_decoration_layout (dummy_bar, "menu:close");
+    ptr = orig_gtk_header_bar_get_decoration_layout (dummy_bar);
+    offset = find_unique_pointer_in_region (header_bar_priv, gtk_header_bar_private_size, ptr);
+    if (offset < 0) {
+        g_warning ("libgtk3-nocsd: error trying to determine this Gtk's runtime data structure layout: GtkHeaderBar private structure doesn't contain a pointer to decoration_layout after setting it (error type %d)", -offset);
+        return -1;
+    }
+
+    /* We now verify that the pointer is NULL */
+    orig_gtk_header_bar_set_decoration_layout (dummy_bar, NULL);
+    ptr_in_priv = (const gchar **) &((char *)header_bar_priv)[offset];
+    if (*ptr_in_priv != NULL) {
+        g_warning ("libgtk3-nocsd: error trying to determine this Gtk's runtime data structure layout: GtkHeaderBar's priv->decoration_layout pointer position sanity check failed (got pointer %p instead of NULL)", *ptr_in_priv);
+        return -1;
+    }
+
+    /* Run the realize function of GtkHeaderBar to capture the
+     * _gtk_header_bar_update_window_buttons callback it connects to the
+     * settings. */
+    settings = gtk_widget_get_settings (GTK_WIDGET (dummy_bar));
+    begin_signal_capture (&capture, 1);
+    if (orig_gtk_header_bar_realize && gtk_header_bar_parent_class) {
+        realize_header_bar_without_window (dummy_bar);
+        /* The header bar isn't marked as realized, so it won't be
+         * unrealized either, which is where the handlers would be
+         * disconnected again. */
+        end_signal_capture ();
+        if (capture.callback)
+            g_signal_handlers_disconnect_by_func (settings, capture.callback, dummy_bar);
+    } else {
+        gtk_widget_realize (GTK_WIDGET (dummy_bar));
+        end_signal_capture ();
+    }
+
+    if (capture.callback == NULL) {
+        g_warning ("libgtk3-nocsd: error trying to determine this Gtk's callback routine for GtkHeaderBar's button update");
+        return -1;
+    }
+
+    info->decoration_layout_offset = offset;
+    info->update_window_buttons = (update_window_buttons_t) capture.callback;
+    /* Don't check ws_cb, it may be NULL, because older Gtk+3 versions didn't use that. */
+    info->window_state_changed = (window_state_changed_t) ws_cb;
+    return 0;
+}
+
+/* Determine the given parts of layout with a single pair of dummy
+ * widgets, and return which of them could be determined.
+ *
+ * We have to detect the offset of where the title_box pointer is stored
+ * in a GtkWindowPrivate object. This is required because we need to
+ * change the pointer inside GtkWindowPrivate causing any side effects
+ * (especially without enabling CSD) - and the set_titlebar function will
+ * enable CSD (in >= 3.16.1) if any non-NULL titlebar is set. Therefore,
+ * we need to find the pointer offset within the private data at runtime
+ * (it's not guaranteed to be stable ABI-wise, so we can't just hard-code
+ * things, that would lead to crashes). Furthermore, we need to know the
+ * address of the static callback function that's used to process the
+ * notify::title signal emitted by header bars. The same goes for the
+ * decoration_layout string of GtkHeaderBarPrivate and the callbacks a
+ * header bar connects to its window and to the settings.
+ *
+ * The basic algorithm is as follows: create a dummy GtkWindow, create a
+ * dummy GtkHeaderBar, call the original gtk_window_set_titlebar function
+ * (capturing the handlers the header bar and the window connect to each
+ * other) and then look for the pointer in the private data region of
+ * the GtkWindow. The size of the region was recorded by us when the type
+ * was registered, so we will stay within the proper memory region. Then
+ * do the same for the decoration layout of the header bar, and run its
+ * realize function to capture its settings handler. Nothing is ever
+ * realized, so probing doesn't talk to the display server at all.
+ */
+static int probe_private_layout (gtk_private_layout_t *layout, int parts)
+{
+    GtkWindow *dummy_window = GTK_WINDOW (gtk_window_new (GTK_WINDOW_TOPLEVEL));
+    GtkHeaderBar *dummy_bar = GTK_HEADER_BAR (gtk_header_bar_new ());
+    signal_capture_t captures[2] = {
+        { "notify::title", dummy_bar, NULL, NULL },
+        { "window-state-event", dummy_window, NULL, NULL }
+    };
+    void *window_priv = NULL;
+    int offset = -1;
+    int probed = 0;
+
+    /* We're collecting information, so make sure all hacks
+     * are NOOPS. */
+    TLSD->in_info_collect = 1;
+
+    if (!dummy_window || !dummy_bar) {
+        g_warning ("libgtk3-nocsd: couldn't create dummy objects (GtkWindow, GtkHeaderBar) to determine this Gtk's runtime data structure layout");
+        goto out;
+    }
+
+    if (parts & LAYOUT_PROBE_WINDOW) {
+        /* First let's try to make sure the pointer is not present in
+         * the memory region. */
+        window_priv = G_TYPE_INSTANCE_GET_PRIVATE (dummy_window, gtk_window_type, void);
+        offset = find_unique_pointer_in_region (window_priv, gtk_window_private_size, dummy_bar);
+        if (offset != -1) {
+            g_warning ("libgtk3-nocsd: error trying to determine this Gtk's runtime data structure layout: GtkWindow private structure already contained a pointer to GtkHeaderBar before setting title bar");
+            parts &= ~LAYOUT_PROBE_WINDOW;
+        }
+    }
+
+    /* Set the title bar via the original title bar function. */
+    begin_signal_capture (captures, 2);
+    orig_gtk_window_set_titlebar (dummy_window, GTK_WIDGET (dummy_bar));
+    end_signal_capture ();
+
+    if (parts & LAYOUT_PROBE_WINDOW) {
+        /* Now find the pointer in memory. */
+        offset = find_unique_pointer_in_region (window_priv, gtk_window_private_size, dummy_bar);
+        if (offset < 0) {
+            g_warning ("libgtk3-nocsd: error trying to determine this Gtk's runtime data structure layout: GtkWindow private structure doesn't contain a pointer to GtkHeaderBar after setting title bar (error type %d)", -offset);
+        } else if (captures[0].callback == NULL) {
+            g_warning ("libgtk3-nocsd: error trying to determine this Gtk's callback routine for GtkHeaderBar/GtkWindow interaction");
+        } else {
+            layout->window.on_titlebar_title_notify = (on_titlebar_title_notify_t) captures[0].callback;
+            layout->window.title_box_offset = offset;
+            probed |= LAYOUT_PROBE_WINDOW;
         }
     }
-    return info;
+
+    if ((parts & LAYOUT_PROBE_HEADER_BAR) && probe_header_bar_layout (dummy_bar, captures[1].callback, &layout->header_bar) == 0)
+        probed |= LAYOUT_PROBE_HEADER_BAR;
+
+out:
+    if (dummy_window) gtk_widget_destroy (GTK_WIDGET (dummy_window));
+    else if (dummy_bar) gtk_widget_destroy (GTK_WIDGET (dummy_bar));
+
+    TLSD->in_info_collect = 0;
+    return probed;
+}
+
+/* The layout as far as it is known. Every distinct combination of parts
+ * gets a slot of its own that is written exactly once (the set of known
+ * parts only ever grows), so readers can use whatever private_layout
+ * points to without taking a lock, and always see both parts of one
+ * probe session together. */
+static gtk_private_layout_t private_layout_slots[LAYOUT_PROBES_ALL + 1] = {
+    { 0, { (gsize) -1, NULL }, { (gsize) -1, NULL, NULL } }
+};
+static const gtk_private_layout_t *private_layout = &private_layout_slots[0];
+static pthread_mutex_t private_layout_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Determine everything of the layout that isn't known yet in one go
+ * (from the cache if possible), because the first title bar needs both
+ * the GtkWindow and the GtkHeaderBar part anyway. */
+static const gtk_private_layout_t *update_private_layout (int wanted)
+{
+    const gtk_private_layout_t *current;
+    gtk_private_layout_t layout;
+    unsigned long long start;
+    int parts, found, probed = 0;
+
+    pthread_mutex_lock (&private_layout_mutex);
+    current = private_layout;
+    if ((current->probed & wanted) == wanted)
+        goto out;
+
+    layout = *current;
+    parts = LAYOUT_PROBES_ALL & ~layout.probed;
+    if (gtk_window_private_size == 0)
+        parts &= ~LAYOUT_PROBE_WINDOW;
+    /* GtkHeaderBar's decoration layout was only introduced in Gtk+3 >=
+     * 3.12. Unlikely that someone is still using such an old version,
+     * but be safe nevertheless. */
+    if (!GTK_AT_LEAST (3, 12, 0) || gtk_header_bar_private_size == 0)
+        parts &= ~LAYOUT_PROBE_HEADER_BAR;
+    if (!parts)
+        goto out;
+
+    start = stats_timer_start ();
+    found = layout_cache_get (&layout, parts);
+    if (parts & ~found) {
+        probed = probe_private_layout (&layout, parts & ~found);
+        if (probed)
+            layout_cache_put (&layout, probed);
+    }
+    probed |= found;
+    stats_timer_stop (&stats.probe_ns, start);
+
+    if (probed) {
+        layout.probed |= probed;
+        private_layout_slots[layout.probed] = layout;
+        current = &private_layout_slots[layout.probed];
+        __atomic_store_n (&private_layout, current, __ATOMIC_RELEASE);
+    }
+
+out:
+    pthread_mutex_unlock (&private_layout_mutex);
+    if (probed)
+        layout_probe_finished (current->probed);
+    return current;
+}
+
+static inline const gtk_private_layout_t *get_private_layout (int wanted)
+{
+    const gtk_private_layout_t *layout = __atomic_load_n (&private_layout, __ATOMIC_ACQUIRE);
+    if (G_UNLIKELY ((layout->probed & wanted) != wanted))
+        layout = update_private_layout (wanted);
+    return layout;
+}
+
+/* Idle callback, see schedule_speculative_probe */
+static gboolean speculative_probe (gpointer data)
+{
+    /* Make sure GtkHeaderBar is registered (and its private size known),
+     * so both parts are probed in one go. */
+    (void) gtk_header_bar_get_type ();
+    (void) get_private_layout (LAYOUT_PROBES_ALL);
+    return G_SOURCE_REMOVE;
+}
+
+static gtk_window_private_info_t gtk_window_private_info ()
+{
+    return get_private_layout (LAYOUT_PROBE_WINDOW)->window;
+}
+
+static gtk_header_bar_private_info_t gtk_header_bar_private_info ()
+{
+    return get_private_layout (LAYOUT_PROBE_HEADER_BAR)->header_bar;
 }
 
 gboolean g_function_info_prep_invoker (GIFunctionInfo *info, GIFunctionInvoker *invoker, GError **error)
@@ -1418,6 +3145,9 @@ gboolean g_function_info_prep_invoker (GIFunctionInfo *info, GIFunctionInvoker *
     static gpointer orig_set_titlebar = NULL, orig_set_show_close_button = NULL, orig_set_decoration_layout = NULL;
     gboolean result;
 
+    if (passthrough & PASSTHROUGH_EXCLUDED)
+        return orig_g_function_info_prep_invoker (info, invoker, error);
+
     if (!orig_set_titlebar)
         orig_set_titlebar = (gpointer) find_orig_function (0, GTK_LIBRARY, "gtk_window_set_titlebar");
     if (!orig_set_show_close_button)
@@ -1438,12 +3168,32 @@ gboolean g_function_info_prep_invoker (GIFunctionInfo *info, GIFunctionInvoker *
     return result;
 }
 
+static void free_tls_data(void *ptr)
+{
+  gtk3_nocsd_tls_data_t *tls = ptr;
+
+  /* Hand the statistics block over to the next new thread; what has
+   * been counted in it so far still shows up in the totals. */
+  if (tls->hook_stats)
+    __atomic_store_n (&tls->hook_stats->in_use, 0, __ATOMIC_RELEASE);
+  free (tls);
+}
+
 static void create_key_tls()
 {
   int r;
-  r = pthread_key_create (&key_tls, free);
-  if (r < 0)
-    g_error ("libgtk3-nocsd: unable to initialize TLS data: %s", strerror(errno));
+  r = pthread_key_create (&key_tls, free_tls_data);
+  if (r != 0)
+    g_error ("libgtk3-nocsd: unable to initialize TLS data: %s", strerror(r));
+  __atomic_store_n (&key_tls_created, 1, __ATOMIC_RELEASE);
+}
+
+/* Create the key as early as possible, so that tls_data_location()
+ * doesn't need to go through pthread_once() every time. (Other
+ * libraries' constructors may call us before this one ran, though.) */
+__attribute__((constructor)) static void init_key_tls(void)
+{
+  (void) pthread_once (&key_tls_once, create_key_tls);
 }
 
 static gtk3_nocsd_tls_data_t *tls_data_location()
@@ -1451,8 +3201,9 @@ static gtk3_nocsd_tls_data_t *tls_data_location()
   void *ptr;
   int r;
 
-  (void) pthread_once (&key_tls_once, create_key_tls);
-  if ((ptr = pthread_getspecific (key_tls)) == NULL) {
+  if (G_UNLIKELY (!__atomic_load_n (&key_tls_created, __ATOMIC_ACQUIRE)))
+    (void) pthread_once (&key_tls_once, create_key_tls);
+  if (G_UNLIKELY ((ptr = pthread_getspecific (key_tls)) == NULL)) {
     ptr = calloc (1, sizeof (gtk3_nocsd_tls_data_t));
     if (!ptr)
       g_error ("libgtk3-nocsd: unable to initialize TLS data: %s", strerror(errno));
@@ -0,0 +1,130 @@
+/*
+ * test-layout: Verify that the decoration layout rewriter gives exactly
+ * the same results as the original g_strsplit() based implementation
+ *
+ * A number of fixed cases (empty entries, empty sides, more than one
+ * colon, ...) are checked first, then a lot of random layouts built
+ * from button names, custom entries and separators. Layouts that don't
+ * fit into the buffer must be rejected.
+ *
+ * Prints the first mismatch to stderr and exits with a non-zero
+ * status, or prints the number of layouts checked.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "decoration-layout.h"
+
+/* The implementation from before the rewriter, without the length
+ * limit, with its output in a string of arbitrary size. */
+static gchar *reference_remove_buttons_from_layout (const char *old_layout)
+{
+  GString *new_layout = g_string_new ("");
+  gchar **tokens;
+  gchar **t;
+  int i, j, k;
+
+  tokens = g_strsplit (old_layout, ":", 2);
+  for (i = 0; i < 2; i++) {
+    if (tokens[i] == NULL)
+      break;
+    if (i)
+      g_string_append (new_layout, ":");
+    t = g_strsplit (tokens[i], ",", -1);
+    for (j = 0, k = 0; t[j]; j++) {
+      if (!strcmp (t[j], "icon") || !strcmp (t[j], "minimize") || !strcmp (t[j], "maximize") || !strcmp (t[j], "close"))
+        continue;
+      if (k)
+        g_string_append (new_layout, ",");
+      g_string_append (new_layout, t[j]);
+      k++;
+    }
+    g_strfreev (t);
+  }
+  g_strfreev (tokens);
+
+  return g_string_free (new_layout, FALSE);
+}
+
+static int check (const char *layout)
+{
+  char new_layout[DECORATION_LAYOUT_SIZE];
+  gchar *expected = reference_remove_buttons_from_layout (layout);
+  int r = remove_buttons_from_layout (new_layout, layout);
+  int ok;
+
+  if (strlen (expected) >= DECORATION_LAYOUT_SIZE)
+    ok = (r == -1);
+  else
+    ok = (r == 0 && strcmp (new_layout, expected) == 0);
+
+  if (!ok)
+    fprintf (stderr, "ERROR: layout \"%s\": expected \"%s\", got \"%s\" (%d)\n",
+                     layout, expected, r == 0 ? new_layout : "", r);
+  g_free (expected);
+  return ok;
+}
+
+static const char *fixed_cases[] = {
+  "",
+  ":",
+  "::",
+  ",",
+  ",:,",
+  "close",
+  ":close",
+  "close:",
+  "menu:minimize,maximize,close",
+  "icon,menu:close",
+  "menu,,close:,minimize,",
+  "menu:close:icon",
+  "a:b:c,close",
+  "closer,clos,iconic,minimize2",
+  ",,,:,,,",
+  "appmenu:",
+  NULL
+};
+
+static const char *pieces[] = {
+  "icon", "minimize", "maximize", "close", "menu", "appmenu", "spacer",
+  "x", "", "clos", "closed", "Close", ",", ",", ",", ":", ":"
+};
+
+int main (int argc, char **argv)
+{
+  char layout[4 * DECORATION_LAYOUT_SIZE];
+  const char **fixed;
+  int iterations = argc > 1 ? atoi (argv[1]) : 100000;
+  int i, n, count = 0;
+  size_t len, piece_len;
+  const char *piece;
+
+  for (fixed = fixed_cases; *fixed; fixed++, count++) {
+    if (!check (*fixed))
+      return 1;
+  }
+
+  srand (42);
+  for (i = 0; i < iterations; i++, count++) {
+    /* Mostly short layouts, some of them near or over the limit. */
+    n = (i % 16 == 0) ? rand () % 120 : rand () % 12;
+    layout[0] = '\0';
+    len = 0;
+    while (n-- > 0) {
+      piece = pieces[rand () % (sizeof (pieces) / sizeof (pieces[0]))];
+      piece_len = strlen (piece);
+      if (len + piece_len >= sizeof (layout))
+        break;
+      memcpy (layout + len, piece, piece_len + 1);
+      len += piece_len;
+    }
+    if (!check (layout))
+      return 1;
+  }
+
+  printf ("%d\n", count);
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * test-threads: Resolve functions from a lot of threads at once
+ *
+ * GLib is loaded with RTLD_LOCAL, like a python module would load it,
+ * so dlsym(RTLD_NEXT, ...) can't find it and find_orig_function() has
+ * to get a handle of the library itself. 64 threads then start at the
+ * same time and all of them look up GLib functions, both through the
+ * rtlookup wrappers and through find_orig_function() directly, and
+ * look for a library that isn't loaded at all.
+ *
+ * Checks that every thread gets the right functions, that a handle is
+ * kept, and that a library that isn't loaded is not looked for again
+ * before anything new has been loaded.
+ *
+ * Prints the first problem to stderr and exits with a non-zero status.
+ */
+#include "gtk3-nocsd.c"
+
+#define NUM_THREADS 64
+#define ITERATIONS  1000
+
+static pthread_barrier_t barrier;
+static void *expected_g_strdup;
+static volatile int failures = 0;
+
+static unsigned long dlopen_attempts ()
+{
+  const gtk3_nocsd_hook_stats_t *block;
+  unsigned long calls = 0;
+
+  for (block = __atomic_load_n (&hook_stats_list, __ATOMIC_ACQUIRE); block; block = block->next)
+    calls += block->calls[HOOK_find_orig_function_dlopen];
+  return calls;
+}
+
+static void *thread_main (void *data)
+{
+  gchar *copy;
+  int i;
+
+  pthread_barrier_wait (&barrier);
+  for (i = 0; i < ITERATIONS; i++) {
+    if (find_orig_function (0, GLIB_LIBRARY, "g_strdup") != expected_g_strdup) {
+      fprintf (stderr, "ERROR: find_orig_function returned the wrong g_strdup\n");
+      __sync_fetch_and_add (&failures, 1);
+      break;
+    }
+    if (find_orig_function (0, GTK_LIBRARY, "gtk_window_new") != NULL) {
+      fprintf (stderr, "ERROR: found gtk_window_new, but Gtk is not loaded\n");
+      __sync_fetch_and_add (&failures, 1);
+      break;
+    }
+    copy = rtlookup_g_strdup ("test-threads");
+    if (!copy || strcmp (copy, "test-threads") != 0) {
+      fprintf (stderr, "ERROR: g_strdup via the runtime import did not work\n");
+      __sync_fetch_and_add (&failures, 1);
+      break;
+    }
+    rtlookup_g_free (copy);
+  }
+  return NULL;
+}
+
+int main (int argc, char **argv)
+{
+  pthread_t threads[NUM_THREADS];
+  unsigned long attempts;
+  void *glib;
+  int i;
+
+  glib = dlopen (GLIB_LIBRARY_SONAME, RTLD_NOW | RTLD_LOCAL);
+  if (!glib) {
+    fprintf (stderr, "ERROR: could not load %s: %s\n", GLIB_LIBRARY_SONAME, dlerror ());
+    return 1;
+  }
+  expected_g_strdup = dlsym (glib, "g_strdup");
+  if (dlsym (RTLD_NEXT, "g_strdup")) {
+    fprintf (stderr, "ERROR: GLib is visible globally, the test would not test anything\n");
+    return 1;
+  }
+
+  /* Count the dlopen() attempts */
+  stats_enabled = 1;
+
+  pthread_barrier_init (&barrier, NULL, NUM_THREADS);
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create (&threads[i], NULL, thread_main, NULL);
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_join (threads[i], NULL);
+  if (failures)
+    return 1;
+
+  if (library_handles[GLIB_LIBRARY] != glib) {
+    fprintf (stderr, "ERROR: no handle kept for %s\n", GLIB_LIBRARY_SONAME);
+    return 1;
+  }
+
+  /* Every thread may have tried to find Gtk once before the first
+   * failure was recorded, but nothing more. */
+  attempts = dlopen_attempts ();
+  if (attempts > 2 * NUM_THREADS) {
+    fprintf (stderr, "ERROR: %lu dlopen() attempts from %d threads\n", attempts, NUM_THREADS);
+    return 1;
+  }
+  for (i = 0; i < ITERATIONS; i++)
+    (void) find_orig_function (0, GTK_LIBRARY, "gtk_window_new");
+  if (dlopen_attempts () != attempts) {
+    fprintf (stderr, "ERROR: looked for Gtk again although nothing was loaded\n");
+    return 1;
+  }
+  stats_enabled = 0;
+
+  return 0;
+}
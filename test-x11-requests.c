@@ -0,0 +1,98 @@
+/*
+ * test-x11-requests: Count the requests sent to the X server while the
+ * first title bar of a program is set
+ *
+ * Prints the number of X requests gtk_window_set_titlebar() causes for
+ * a window that isn't realized yet, which without libgtk3-nocsd.so is
+ * none. With the library preloaded, this is where it probes Gtk's
+ * private data structures (GTK3_NOCSD_NO_CACHE has to be set, so that
+ * the layout cache doesn't hide that), which must not talk to the X
+ * server either. 'make check-x11' runs this once without and once with
+ * the library preloaded and compares the output.
+ *
+ * With the argument motif-hints, prints how often the _MOTIF_WM_HINTS
+ * property (which holds the decorations of a window) is changed while
+ * a window with a header bar as its title bar is realized and shown.
+ * With the library preloaded, that must be at most once.
+ *
+ * Requires an X display (check-x11 uses Xvfb by default).
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <gtk/gtk.h>
+#include <gdk/gdkx.h>
+
+static Atom counted_property = None;
+static int property_changes = 0;
+
+/* Gdk calls this from libgdk, so the definition here takes precedence
+ * over the one in libX11. */
+int XChangeProperty (Display *display, Window w, Atom property, Atom type, int format,
+                     int mode, _Xconst unsigned char *data, int nelements)
+{
+  static int (*orig_XChangeProperty) (Display *, Window, Atom, Atom, int, int, _Xconst unsigned char *, int) = NULL;
+
+  if (!orig_XChangeProperty)
+    orig_XChangeProperty = dlsym (RTLD_NEXT, "XChangeProperty");
+  if (property != None && property == counted_property)
+    property_changes++;
+  return orig_XChangeProperty (display, w, property, type, format, mode, data, nelements);
+}
+
+static int count_motif_hints (Display *xdisplay)
+{
+  GtkWidget *window, *header_bar;
+
+  counted_property = XInternAtom (xdisplay, "_MOTIF_WM_HINTS", False);
+
+  window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  header_bar = gtk_header_bar_new ();
+  gtk_header_bar_set_title (GTK_HEADER_BAR (header_bar), "test-x11-requests");
+  gtk_window_set_titlebar (GTK_WINDOW (window), header_bar);
+  gtk_widget_show_all (window);
+  while (gtk_events_pending ())
+    gtk_main_iteration ();
+  XSync (xdisplay, False);
+  printf ("%d\n", property_changes);
+
+  gtk_widget_destroy (window);
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  GdkDisplay *display;
+  Display *xdisplay;
+  GtkWidget *window, *header_bar;
+  unsigned long before, after;
+
+  gdk_set_allowed_backends ("x11");
+  if (!gtk_init_check (&argc, &argv)) {
+    fprintf (stderr, "ERROR: could not initialize Gtk (no X display?)\n");
+    return 1;
+  }
+  display = gdk_display_get_default ();
+  if (!GDK_IS_X11_DISPLAY (display)) {
+    fprintf (stderr, "ERROR: not running on X11\n");
+    return 1;
+  }
+  xdisplay = GDK_DISPLAY_XDISPLAY (display);
+
+  if (argc > 1 && strcmp (argv[1], "motif-hints") == 0)
+    return count_motif_hints (xdisplay);
+
+  window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  header_bar = gtk_header_bar_new ();
+
+  XSync (xdisplay, False);
+  before = XNextRequest (xdisplay);
+  gtk_window_set_titlebar (GTK_WINDOW (window), header_bar);
+  after = XNextRequest (xdisplay);
+  printf ("%lu\n", after - before);
+
+  gtk_widget_destroy (window);
+  return 0;
+}